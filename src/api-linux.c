@@ -1,4 +1,7 @@
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -9,6 +12,16 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <utmp.h>
+#include <pwd.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <regex.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
 
 #include <Rinternals.h>
 
@@ -17,15 +30,6 @@
 double psll_linux_boot_time = 0;
 double psll_linux_clock_period = 0;
 
-typedef struct {
-  char state;
-  int ppid, pgrp, session, tty_nr, tpgid;
-  unsigned int flags;
-  unsigned long minflt, cminflt, majflt, cmajflt, utime, stime;
-  long int cutime, cstime, priority, nice, num_threads, itrealvalue;
-  unsigned long long starttime;
-} psl_stat_t;
-
 #define PS__TV2DOUBLE(t) ((t).tv_sec + (t).tv_usec / 1000000.0)
 
 #define PS__CHECK_STAT(stat, handle)			\
@@ -42,7 +46,7 @@ typedef struct {
 #define PS__CHECK_HANDLE(handle)			\
   do {							\
     psl_stat_t stat;					\
-    if (psll__parse_stat_file(handle->pid, &stat, 0)) {	\
+    if (psll__handle_stat(handle, &stat, 0)) {	\
       ps__wrap_linux_error(handle);			\
       ps__throw_error();				\
     }							\
@@ -84,15 +88,31 @@ static void *ps__memmem(const void *haystack, size_t n1,
   return NULL;
 }
 
+static void psll__oneshot_clear(psl_oneshot_t *os);
+static void psll__pidfd_close(ps_handle_t *handle);
+static void psll__procfd_close(ps_handle_t *handle);
+
 void psll_finalizer(SEXP p) {
   ps_handle_t *handle = R_ExternalPtrAddr(p);
-  if (handle) free(handle);
+  if (handle) {
+    psll__oneshot_clear(&handle->oneshot);
+    psll__pidfd_close(handle);
+    psll__procfd_close(handle);
+    free(handle);
+  }
 }
 
 void ps__wrap_linux_error(ps_handle_t *handle) {
   char path[512];
   int ret;
 
+  /* Through a held /proc/<pid> directory, this means that the process
+     is gone, even if its pid was reused since. */
+  if (handle->procfd && errno == ESRCH) {
+    ps__no_such_process(handle->pid, 0);
+    ps__throw_error();
+  }
+
   if (errno == ENOENT || errno == ESRCH) {
     /* no such file error; might be raised also if the */
     /* path actually exists for system processes with */
@@ -170,11 +190,203 @@ int psll__readlink(const char *path, char **linkname) {
   return 0;
 }
 
+/* Read the next, possibly negative, decimal number. Negative numbers
+   wrap around, like for strtoul(), the caller casts them back. */
+
+static int psll__stat_number(char **ptr, unsigned long long *value) {
+  char *p = *ptr;
+  unsigned long long v = 0;
+  int neg = 0;
+
+  while (*p == ' ') p++;
+  if (*p == '-') {
+    neg = 1;
+    p++;
+  }
+  if (*p < '0' || *p > '9') return -1;
+  while (*p >= '0' && *p <= '9') v = v * 10 + (*p++ - '0');
+
+  *value = neg ? -v : v;
+  *ptr = p;
+  return 0;
+}
+
+/* Number of numeric fields after the state, and the ones that all
+   kernels have, up to `rss`. */
+
+#define PSL_STAT_FIELDS 49
+#define PSL_STAT_MIN_FIELDS 21
+
+/* Parse the contents of a /proc/<pid>/stat file. `buf` must be zero
+   terminated and writeable, the command name is cut out of it in
+   place. This does not call R at all, returns -1 on a parse error.
+
+   The numbers are read in a single pass, without sscanf(), which is
+   slow for this many fields. */
+
+int psll__parse_stat(char *buf, psl_stat_t *stat, char **name) {
+  unsigned long long f[PSL_STAT_FIELDS];
+  char *l, *r, *p;
+  int n = 0;
+
+  /* Find the first '(' and last ')', that's the end of the command */
+  l = strchr(buf, '(');
+  r = strrchr(buf, ')');
+  if (!l || !r || r[1] != ' ' || !r[2]) return -1;
+
+  *r = '\0';
+  if (name) *name = l + 1;
+
+  stat->state = r[2];
+  p = r + 3;
+  while (n < PSL_STAT_FIELDS && !psll__stat_number(&p, f + n)) n++;
+  if (n < PSL_STAT_MIN_FIELDS) return -1;
+  memset(f + n, 0, (PSL_STAT_FIELDS - n) * sizeof(f[0]));
+
+  stat->ppid = f[0];
+  stat->pgrp = f[1];
+  stat->session = f[2];
+  stat->tty_nr = f[3];
+  stat->tpgid = f[4];
+  stat->flags = f[5];
+  stat->minflt = f[6];
+  stat->cminflt = f[7];
+  stat->majflt = f[8];
+  stat->cmajflt = f[9];
+  stat->utime = f[10];
+  stat->stime = f[11];
+  stat->cutime = f[12];
+  stat->cstime = f[13];
+  stat->priority = f[14];
+  stat->nice = f[15];
+  stat->num_threads = f[16];
+  stat->itrealvalue = f[17];
+  stat->starttime = f[18];
+  stat->vsize = f[19];
+  stat->rss = f[20];
+  stat->rsslim = f[21];
+  stat->startcode = f[22];
+  stat->endcode = f[23];
+  stat->startstack = f[24];
+  stat->kstkesp = f[25];
+  stat->kstkeip = f[26];
+  stat->signal = f[27];
+  stat->blocked = f[28];
+  stat->sigignore = f[29];
+  stat->sigcatch = f[30];
+  stat->wchan = f[31];
+  stat->nswap = f[32];
+  stat->cnswap = f[33];
+  stat->exit_signal = f[34];
+  stat->processor = f[35];
+  stat->rt_priority = f[36];
+  stat->policy = f[37];
+  stat->delayacct_blkio_ticks = f[38];
+  stat->guest_time = f[39];
+  stat->cguest_time = f[40];
+  stat->start_data = f[41];
+  stat->end_data = f[42];
+  stat->start_brk = f[43];
+  stat->arg_start = f[44];
+  stat->arg_end = f[45];
+  stat->env_start = f[46];
+  stat->env_end = f[47];
+  stat->exit_code = f[48];
+
+  return 0;
+}
+
+#ifdef PS__BENCH
+
+/* The previous, sscanf() based parser, that only reads the fields up
+   to `rss`. It is only kept for the benchmark in bench/stat.R. */
+
+static int psll__parse_stat_sscanf(char *buf, psl_stat_t *stat,
+				   char **name) {
+  char *l, *r;
+  int ret;
+
+  l = strchr(buf, '(');
+  r = strrchr(buf, ')');
+  if (!l || !r) return -1;
+
+  *r = '\0';
+  if (name) *name = l + 1;
+
+  ret = sscanf(r+2,
+    "%c %d %d %d %d %d %u %lu %lu %lu %lu %lu %lu %ld %ld %ld %ld %ld %ld %llu "
+    "%lu %ld",
+    &stat->state, &stat->ppid, &stat->pgrp, &stat->session, &stat->tty_nr,
+    &stat->tpgid, &stat->flags, &stat->minflt, &stat->cminflt,
+    &stat->majflt, &stat->cmajflt, &stat->utime, &stat->stime,
+    &stat->cutime, &stat->cstime, &stat->priority, &stat->nice,
+    &stat->num_threads, &stat->itrealvalue, &stat->starttime,
+    &stat->vsize, &stat->rss);
+
+  return ret == 22 ? 0 : -1;
+}
+
+#endif
+
+/* Files of the held /proc/<pid> directories, see ps_keep_open(). The
+   buffers grow if a file does not fit. */
+
+static const struct {
+  const char *name;
+  size_t size;
+} psll__held_files[PSL_HELD_MAX] = {
+  { "stat",   2048 },
+  { "statm",  1024 },
+  { "status", 4096 },
+  { "io",     1024 }
+};
+
+static int psll__held_index(const char *file) {
+  int i;
+  for (i = 0; i < PSL_HELD_MAX; i++) {
+    if (!strcmp(file, psll__held_files[i].name)) return i;
+  }
+  return -1;
+}
+
+/* Read a held file into its buffer, with a single pread() usually.
+   Returns -1 and sets errno on error, ESRCH if the process is gone. */
+
+static ssize_t psll__held_read(ps_handle_t *handle, int which, char **buf) {
+  psl_held_file_t *file = &handle->procfd->files[which];
+  ssize_t ret;
+
+  if (file->fd == -1) {
+    file->fd = openat(handle->procfd->dirfd, psll__held_files[which].name,
+		      O_RDONLY | O_CLOEXEC);
+    if (file->fd == -1) return -1;
+  }
+
+  if (!file->buf) {
+    file->buf = malloc(psll__held_files[which].size);
+    if (!file->buf) return -1;
+    file->size = psll__held_files[which].size;
+  }
+
+  while (1) {
+    char *newbuf;
+    ret = pread(file->fd, file->buf, file->size, 0);
+    if (ret == -1) return -1;
+    if (ret < file->size) break;
+    newbuf = realloc(file->buf, file->size * 2);
+    if (!newbuf) return -1;
+    file->buf = newbuf;
+    file->size *= 2;
+  }
+
+  *buf = file->buf;
+  return ret;
+}
+
 int psll__parse_stat_file(long pid, psl_stat_t *stat, char **name) {
   char path[512];
   int ret;
   char *buf;
-  char *l, *r;
 
   ret = snprintf(path, sizeof(path), "/proc/%ld/stat", pid);
   if (ret >= sizeof(path)) {
@@ -191,41 +403,123 @@ int psll__parse_stat_file(long pid, psl_stat_t *stat, char **name) {
      At least we have a zero terminated string... */
   *(buf + ret - 1) = '\0';
 
-  /* Find the first '(' and last ')', that's the end of the command */
-  l = strchr(buf, '(');
-  r = strrchr(buf, ')');
-  if (!l || !r) {
+  if (psll__parse_stat(buf, stat, name)) {
     ps__set_error("Cannot parse stat file");
     ps__throw_error();
   }
 
-  *r = '\0';
-  if (name) *name = l + 1;
+  return 0;
+}
 
-  ret = sscanf(r+2,
-    "%c %d %d %d %d %d %u %lu %lu %lu %lu %lu %lu %ld %ld %ld %ld %ld %ld %llu",
-    &stat->state, &stat->ppid, &stat->pgrp, &stat->session, &stat->tty_nr,
-    &stat->tpgid, &stat->flags, &stat->minflt, &stat->cminflt,
-    &stat->majflt, &stat->cmajflt, &stat->utime, &stat->stime,
-    &stat->cutime, &stat->cstime, &stat->priority, &stat->nice,
-    &stat->num_threads, &stat->itrealvalue, &stat->starttime);
+/* Parse the stat file of a process handle. Within ps_oneshot() the
+   parsed file is cached in the handle, so it is only read once. */
 
-  if (ret == -1) {
-    return -1;
-  } else if (ret != 20) {
-    ps__set_error("Cannot parse stat file, parsed: %i/20 fields", ret);
+int psll__handle_stat(ps_handle_t *handle, psl_stat_t *stat, char **name) {
+  psl_oneshot_t *os = &handle->oneshot;
+  char *cname;
+
+  if (os->depth > 0 && os->has_stat) {
+    *stat = os->stat;
+    if (name) *name = os->name;
+    return 0;
+  }
+
+  if (handle->procfd) {
+    char *buf;
+    ssize_t ret = psll__held_read(handle, PSL_HELD_STAT, &buf);
+    if (ret <= 0) return -1;
+    buf[ret - 1] = '\0';
+    if (psll__parse_stat(buf, stat, &cname)) {
+      ps__set_error("Cannot parse stat file");
+      ps__throw_error();
+    }
+  } else if (psll__parse_stat_file(handle->pid, stat, &cname)) {
     return -1;
   }
+  if (name) *name = cname;
+
+  if (os->depth > 0) {
+    os->stat = *stat;
+    strncpy(os->name, cname, sizeof(os->name) - 1);
+    os->name[sizeof(os->name) - 1] = '\0';
+    os->has_stat = 1;
+  }
 
   return 0;
 }
 
+/* Read /proc/<pid>/<file> of a process handle, like ps__read_file().
+   Within ps_oneshot() the contents are cached in `cache`. */
+
+static int psll__handle_file(ps_handle_t *handle, const char *file,
+			     psl_oneshot_file_t *cache, char **buf,
+			     size_t buffer_size) {
+  char path[512];
+  int ret, held;
+
+  if (handle->oneshot.depth > 0 && cache->data) {
+    *buf = R_alloc(cache->len, 1);
+    memcpy(*buf, cache->data, cache->len);
+    return cache->len;
+  }
+
+  if (handle->procfd && (held = psll__held_index(file)) != -1) {
+    ret = psll__held_read(handle, held, buf);
+    goto done;
+  }
+
+  ret = snprintf(path, sizeof(path), "/proc/%d/%s", handle->pid, file);
+  if (ret >= sizeof(path)) {
+    ps__set_error("Cannot read proc, path buffer too small");
+    ps__throw_error();
+  } else if (ret < 0) {
+    ps__set_error_from_errno();
+    ps__throw_error();
+  }
+
+  ret = ps__read_file(path, buf, buffer_size);
+
+ done:
+  if (ret > 0 && handle->oneshot.depth > 0) {
+    cache->data = malloc(ret);
+    if (cache->data) {
+      memcpy(cache->data, *buf, ret);
+      cache->len = ret;
+    }
+  }
+
+  return ret;
+}
+
+static void psll__oneshot_clear(psl_oneshot_t *os) {
+  free(os->statm.data);
+  free(os->status.data);
+  free(os->io.data);
+  memset(os, 0, sizeof(psl_oneshot_t));
+}
+
+SEXP psl__oneshot(SEXP p, SEXP enter) {
+  ps_handle_t *handle = R_ExternalPtrAddr(p);
+
+  if (!handle) error("Process pointer cleaned up already");
+
+  if (LOGICAL(enter)[0]) {
+    handle->oneshot.depth++;
+  } else if (handle->oneshot.depth > 0) {
+    if (--handle->oneshot.depth == 0) psll__oneshot_clear(&handle->oneshot);
+  }
+
+  return R_NilValue;
+}
+
 void ps__check_for_zombie(ps_handle_t *handle, int err) {
   psl_stat_t stat;
   double diff;
 
   if (!handle) error("Process pointer cleaned up already");
 
+  /* Not psll__handle_stat(), the stat file cached by ps_oneshot() is
+     stale if the process finished since. */
   if (psll__parse_stat_file(handle->pid, &stat, 0)) {
     ps__wrap_linux_error(handle);
     ps__throw_error();
@@ -277,10 +571,8 @@ int psll_linux_get_clock_period(void) {
   return 0;
 }
 
-int psll_linux_ctime(long pid, double *ctime) {
-  psl_stat_t stat;
-  int ret = psll__parse_stat_file(pid, &stat, 0);
-  if (ret) return ret;
+int psll_linux_init_time(void) {
+  int ret;
 
   if (!psll_linux_boot_time) {
     ret = psll_linux_get_boot_time();
@@ -294,23 +586,179 @@ int psll_linux_ctime(long pid, double *ctime) {
     }
   }
 
+  return 0;
+}
+
+int psll_linux_ctime(long pid, double *ctime) {
+  psl_stat_t stat;
+  int ret = psll__parse_stat_file(pid, &stat, 0);
+  if (ret) return ret;
+
+  ret = psll_linux_init_time();
+  if (ret) return ret;
+
   *ctime = psll_linux_boot_time + stat.starttime * psll_linux_clock_period;
 
   return 0;
 }
 
-SEXP psll_handle(SEXP pid, SEXP time) {
-  pid_t cpid = isNull(pid) ? getpid() : INTEGER(pid)[0];
+/* A pidfd refers to the same process, even if its pid is reused, so we
+   only need to check the create time once, after opening it. It is
+   opened on first use, and if pidfds are not supported, or there are
+   too many open already, then we fall back to the pid. */
+
+#define PSL_PIDFD_UNTRIED -2
+#define PSL_PIDFD_NONE    -1
+#define PSL_PIDFD_MAX     256
+
+static int psll__num_pidfds = 0;
+
+static int psll__pidfd(ps_handle_t *handle) {
+  if (handle->pidfd != PSL_PIDFD_UNTRIED) return handle->pidfd;
+  handle->pidfd = PSL_PIDFD_NONE;
+
+#ifdef SYS_pidfd_open
+  if (psll__num_pidfds < PSL_PIDFD_MAX) {
+    double ctime;
+    int fd = syscall(SYS_pidfd_open, handle->pid, 0);
+    if (fd == -1) return PSL_PIDFD_NONE;
+    if (psll_linux_ctime(handle->pid, &ctime) ||
+	fabs(ctime - handle->create_time) > psll_linux_clock_period) {
+      close(fd);
+      return PSL_PIDFD_NONE;
+    }
+    handle->pidfd = fd;
+    psll__num_pidfds++;
+  }
+#endif
+
+  return handle->pidfd;
+}
+
+static void psll__pidfd_close(ps_handle_t *handle) {
+  if (handle->pidfd >= 0) {
+    close(handle->pidfd);
+    psll__num_pidfds--;
+  }
+  handle->pidfd = PSL_PIDFD_NONE;
+}
+
+/* Returns 1 if there is no pidfd, and the caller needs to use kill().
+   Otherwise the same as kill(). */
+
+int psll__pidfd_kill(ps_handle_t *handle, int sig) {
+#ifdef SYS_pidfd_send_signal
+  int pidfd = psll__pidfd(handle);
+  if (pidfd >= 0) return syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+#endif
+  return 1;
+}
+
+/* A held /proc/<pid> directory refers to the original process, reads
+   fail with ESRCH once it is gone, even if its pid is reused. So, just
+   like for pidfds, we only check the create time after opening it. Each
+   held handle uses up to five file descriptors, so their number is
+   limited. */
+
+#define PSL_PROCFD_MAX 256
+
+static int psll__num_procfds = 0;
+
+static void psll__procfd_close(ps_handle_t *handle) {
+  int i;
+  psl_procfd_t *procfd = handle->procfd;
+  if (!procfd) return;
+
+  for (i = 0; i < PSL_HELD_MAX; i++) {
+    if (procfd->files[i].fd != -1) close(procfd->files[i].fd);
+    free(procfd->files[i].buf);
+  }
+  close(procfd->dirfd);
+  free(procfd);
+  handle->procfd = NULL;
+  psll__num_procfds--;
+}
+
+/* Returns 0 if the directory is held, 1 if there are too many held
+   already, and -1 on error, with errno set. */
+
+static int psll__procfd_open(ps_handle_t *handle) {
+  char path[64];
+  psl_procfd_t *procfd;
+  psl_stat_t stat;
   double ctime;
-  ps_handle_t *handle;
-  SEXP res;
+  char *buf;
+  ssize_t ret;
+  int i, fd;
 
-  if (!isNull(time))  {
-    ctime = REAL(time)[0];
-  } else {
-    if (psll_linux_ctime(cpid, &ctime)) ps__throw_error();
+  if (handle->procfd) return 0;
+  if (psll__num_procfds >= PSL_PROCFD_MAX) return 1;
+
+  snprintf(path, sizeof(path), "/proc/%d", (int) handle->pid);
+  fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) return -1;
+
+  procfd = malloc(sizeof(psl_procfd_t));
+  if (!procfd) {
+    close(fd);
+    return -1;
+  }
+  procfd->dirfd = fd;
+  for (i = 0; i < PSL_HELD_MAX; i++) {
+    procfd->files[i].fd = -1;
+    procfd->files[i].size = 0;
+    procfd->files[i].buf = NULL;
+  }
+  handle->procfd = procfd;
+  psll__num_procfds++;
+
+  /* The pid might belong to another process already. This reads the
+     new directory, not the stat file cached by ps_oneshot(). */
+  ret = psll__held_read(handle, PSL_HELD_STAT, &buf);
+  if (ret > 0) buf[ret - 1] = '\0';
+  if (ret <= 0 || psll__parse_stat(buf, &stat, 0)) {
+    int err = ret == -1 ? errno : EINVAL;
+    psll__procfd_close(handle);
+    errno = err;
+    return -1;
+  }
+  ctime = psll_linux_boot_time + stat.starttime * psll_linux_clock_period;
+  if (fabs(ctime - handle->create_time) > psll_linux_clock_period) {
+    psll__procfd_close(handle);
+    errno = ESRCH;
+    return -1;
+  }
+
+  return 0;
+}
+
+SEXP psl__keep_open(SEXP p, SEXP keep) {
+  ps_handle_t *handle = R_ExternalPtrAddr(p);
+  int ret;
+
+  if (!handle) error("Process pointer cleaned up already");
+
+  if (!LOGICAL(keep)[0]) {
+    psll__procfd_close(handle);
+    return ScalarLogical(0);
+  }
+
+  ret = psll__procfd_open(handle);
+  if (ret == -1) {
+    if (errno == ENOENT || errno == ESRCH) {
+      ps__no_such_process(handle->pid, 0);
+      ps__throw_error();
+    }
+    ps__wrap_linux_error(handle);
   }
 
+  return ScalarLogical(ret == 0);
+}
+
+SEXP psll__handle(pid_t pid, double ctime) {
+  ps_handle_t *handle;
+  SEXP res;
+
   handle = malloc(sizeof(ps_handle_t));
 
   if (!handle) {
@@ -318,9 +766,12 @@ SEXP psll_handle(SEXP pid, SEXP time) {
     ps__throw_error();
   }
 
-  handle->pid = cpid;
+  handle->pid = pid;
   handle->create_time = ctime;
   handle->gone = 0;
+  memset(&handle->oneshot, 0, sizeof(psl_oneshot_t));
+  handle->pidfd = PSL_PIDFD_UNTRIED;
+  handle->procfd = NULL;
 
   PROTECT(res = R_MakeExternalPtr(handle, R_NilValue, R_NilValue));
   R_RegisterCFinalizerEx(res, psll_finalizer, /* onexit */ 0);
@@ -330,6 +781,19 @@ SEXP psll_handle(SEXP pid, SEXP time) {
   return res;
 }
 
+SEXP psll_handle(SEXP pid, SEXP time) {
+  pid_t cpid = isNull(pid) ? getpid() : INTEGER(pid)[0];
+  double ctime;
+
+  if (!isNull(time))  {
+    ctime = REAL(time)[0];
+  } else {
+    if (psll_linux_ctime(cpid, &ctime)) ps__throw_error();
+  }
+
+  return psll__handle(cpid, ctime);
+}
+
 SEXP psll_format(SEXP p) {
   ps_handle_t *handle = R_ExternalPtrAddr(p);
   psl_stat_t stat;
@@ -338,7 +802,7 @@ SEXP psll_format(SEXP p) {
 
   if (!handle) error("Process pointer cleaned up already");
 
-  if (psll__parse_stat_file(handle->pid, &stat, &cname)) {
+  if (psll__handle_stat(handle, &stat, &cname)) {
     PROTECT(name = mkString("???"));
     PROTECT(status = mkString("terminated"));
   } else {
@@ -364,7 +828,7 @@ SEXP psll_parent(SEXP p) {
 
   if (!handle) error("Process pointer cleaned up already");
 
-  if (psll__parse_stat_file(handle->pid, &stat, 0)) {
+  if (psll__handle_stat(handle, &stat, 0)) {
     ps__wrap_linux_error(handle);
     ps__throw_error();
   }
@@ -387,7 +851,7 @@ SEXP psll_ppid(SEXP p) {
 
   if (!handle) error("Process pointer cleaned up already");
 
-  if (psll__parse_stat_file(handle->pid, &stat, 0)) {
+  if (psll__handle_stat(handle, &stat, 0)) {
     ps__wrap_linux_error(handle);
     ps__throw_error();
   }
@@ -399,10 +863,21 @@ SEXP psll_ppid(SEXP p) {
 SEXP psll_is_running(SEXP p) {
   ps_handle_t *handle = R_ExternalPtrAddr(p);
   double ctime;
-  int ret;
+  int ret, pidfd;
 
   if (!handle) error("Process pointer cleaned up already");
 
+  /* The pidfd becomes readable when the process exits. If it did, then
+     it might still be a zombie, and that counts as running. */
+  pidfd = psll__pidfd(handle);
+  if (pidfd >= 0) {
+    struct pollfd pfd;
+    pfd.fd = pidfd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) == 0) return ScalarLogical(1);
+  }
+
   ret = psll_linux_ctime(handle->pid, &ctime);
   if (ret) return ScalarLogical(0);
 
@@ -416,7 +891,7 @@ SEXP psll_name(SEXP p) {
 
   if (!handle) error("Process pointer cleaned up already");
 
-  if (psll__parse_stat_file(handle->pid, &stat, &name)) {
+  if (psll__handle_stat(handle, &stat, &name)) {
     ps__wrap_linux_error(handle);
     ps__throw_error();
   }
@@ -523,7 +998,7 @@ SEXP psll_status(SEXP p) {
 
   if (!handle) error("Process pointer cleaned up already");
 
-  if (psll__parse_stat_file(handle->pid, &stat, 0)) {
+  if (psll__handle_stat(handle, &stat, 0)) {
     ps__wrap_linux_error(handle);
     ps__throw_error();
   }
@@ -536,15 +1011,18 @@ SEXP psll_status(SEXP p) {
 }
 
 SEXP psll_username(SEXP p) {
-  SEXP ids, ruid, pw, result;
+  SEXP ids;
+  const char *name;
 
   PROTECT(ids = psll_uids(p));
-  PROTECT(ruid = ScalarInteger(INTEGER(ids)[0]));
-  PROTECT(pw = ps__get_pw_uid(ruid));
-  PROTECT(result = VECTOR_ELT(pw, 0));
+  name = ps__username(INTEGER(ids)[0]);
+  if (!name) {
+    ps__set_error("Cannot find user with uid %d", INTEGER(ids)[0]);
+    ps__throw_error();
+  }
 
-  UNPROTECT(4);
-  return result;
+  UNPROTECT(1);
+  return mkString(name);
 }
 
 SEXP psll_cwd(SEXP p) {
@@ -576,7 +1054,6 @@ SEXP psll_cwd(SEXP p) {
 
 SEXP psll__ids(SEXP p, const char *needle) {
   ps_handle_t *handle = R_ExternalPtrAddr(p);
-  char path[512];
   int ret;
   char *buf;
   size_t needle_len  = strlen(needle);
@@ -586,16 +1063,8 @@ SEXP psll__ids(SEXP p, const char *needle) {
 
   if (!handle) error("Process pointer cleaned up already");
 
-  ret = snprintf(path, sizeof(path), "/proc/%i/status", handle->pid);
-  if (ret >= sizeof(path)) {
-    ps__set_error("Cannot read proc, path buffer too small");
-    ps__throw_error();
-  } else if (ret < 0) {
-    ps__set_error_from_errno();
-    ps__throw_error();
-  }
-
-  ret = ps__read_file(path, &buf, /* buffer= */ 2048);
+  ret = psll__handle_file(handle, "status", &handle->oneshot.status, &buf,
+			  /* buffer= */ 2048);
   if (ret == -1) ps__check_for_zombie(handle, 1);
 
   *(buf + ret - 1) = '\0';
@@ -638,7 +1107,7 @@ SEXP psll_terminal(SEXP p) {
 
   if (!handle) error("Process pointer cleaned up already");
 
-  if (psll__parse_stat_file(handle->pid, &stat, 0)) {
+  if (psll__handle_stat(handle, &stat, 0)) {
     ps__wrap_linux_error(handle);
     ps__throw_error();
   }
@@ -701,7 +1170,7 @@ SEXP psll_num_threads(SEXP p) {
 
   if (!handle) error("Process pointer cleaned up already");
 
-  ret = psll__parse_stat_file(handle->pid, &stat, 0);
+  ret = psll__handle_stat(handle, &stat, 0);
   ps__check_for_zombie(handle, ret < 0);
 
   PS__CHECK_STAT(stat, handle);
@@ -709,6 +1178,46 @@ SEXP psll_num_threads(SEXP p) {
   return ScalarInteger(stat.num_threads);
 }
 
+SEXP psl__stat(SEXP p) {
+  ps_handle_t *handle = R_ExternalPtrAddr(p);
+  psl_stat_t stat;
+  char *name;
+  int ret;
+
+  if (!handle) error("Process pointer cleaned up already");
+
+  ret = psll__handle_stat(handle, &stat, &name);
+  ps__check_for_zombie(handle, ret < 0);
+
+  PS__CHECK_STAT(stat, handle);
+
+  return ps__build_named_list(
+    "isCiiiiiIkkkkkkllllllKklkkkkkkkkkkkkkiiIIKklkkkkkkki",
+    "pid", (int) handle->pid, "comm", name, "state", stat.state,
+    "ppid", stat.ppid, "pgrp", stat.pgrp, "session", stat.session,
+    "tty_nr", stat.tty_nr, "tpgid", stat.tpgid, "flags", stat.flags,
+    "minflt", stat.minflt, "cminflt", stat.cminflt, "majflt", stat.majflt,
+    "cmajflt", stat.cmajflt, "utime", stat.utime, "stime", stat.stime,
+    "cutime", stat.cutime, "cstime", stat.cstime,
+    "priority", stat.priority, "nice", stat.nice,
+    "num_threads", stat.num_threads, "itrealvalue", stat.itrealvalue,
+    "starttime", stat.starttime, "vsize", stat.vsize, "rss", stat.rss,
+    "rsslim", stat.rsslim, "startcode", stat.startcode,
+    "endcode", stat.endcode, "startstack", stat.startstack,
+    "kstkesp", stat.kstkesp, "kstkeip", stat.kstkeip,
+    "signal", stat.signal, "blocked", stat.blocked,
+    "sigignore", stat.sigignore, "sigcatch", stat.sigcatch,
+    "wchan", stat.wchan, "nswap", stat.nswap, "cnswap", stat.cnswap,
+    "exit_signal", stat.exit_signal, "processor", stat.processor,
+    "rt_priority", stat.rt_priority, "policy", stat.policy,
+    "delayacct_blkio_ticks", stat.delayacct_blkio_ticks,
+    "guest_time", stat.guest_time, "cguest_time", stat.cguest_time,
+    "start_data", stat.start_data, "end_data", stat.end_data,
+    "start_brk", stat.start_brk, "arg_start", stat.arg_start,
+    "arg_end", stat.arg_end, "env_start", stat.env_start,
+    "env_end", stat.env_end, "exit_code", stat.exit_code);
+}
+
 SEXP psll_cpu_times(SEXP p) {
   ps_handle_t *handle = R_ExternalPtrAddr(p);
   psl_stat_t stat;
@@ -717,7 +1226,7 @@ SEXP psll_cpu_times(SEXP p) {
 
   if (!handle) error("Process pointer cleaned up already");
 
-  ret = psll__parse_stat_file(handle->pid, &stat, 0);
+  ret = psll__handle_stat(handle, &stat, 0);
   ps__check_for_zombie(handle, ret < 0);
 
   PS__CHECK_STAT(stat, handle);
@@ -738,23 +1247,14 @@ SEXP psll_cpu_times(SEXP p) {
 SEXP psll_memory_info(SEXP p) {
   ps_handle_t *handle = R_ExternalPtrAddr(p);
   unsigned long rss, vms, shared, text, lib, data, dirty;
-  char path[512];
   char *buf;
   int ret;
   SEXP result, names;
 
   if (!handle) error("Process pointer cleaned up already");
 
-  ret = snprintf(path, sizeof(path), "/proc/%d/statm", handle->pid);
-  if (ret >= sizeof(path)) {
-    ps__set_error("Cannot read statm, path buffer too small");
-    ps__throw_error();
-  } else if (ret < 0) {
-    ps__set_error_from_errno();
-    ps__throw_error();
-  }
-
-  ret = ps__read_file(path, &buf, /* buffer= */ 1024);
+  ret = psll__handle_file(handle, "statm", &handle->oneshot.statm, &buf,
+			  /* buffer= */ 1024);
   ps__check_for_zombie(handle, ret <= 0);
 
   *(buf + ret - 1) = '\0';
@@ -784,11 +1284,231 @@ SEXP psll_memory_info(SEXP p) {
   return result;
 }
 
-SEXP ps__boot_time() {
-  if (psll_linux_boot_time == 0) {
-    if (psll_linux_get_boot_time()) {
-      ps__set_error_from_errno();
-      ps__throw_error();
+/* The fields that we sum from smaps_rollup, or from all mappings of
+   smaps, if the kernel does not have smaps_rollup. */
+
+enum {
+  PSL_SM_RSS = 0,
+  PSL_SM_PSS,
+  PSL_SM_PRIVATE_CLEAN,
+  PSL_SM_PRIVATE_DIRTY,
+  PSL_SM_SWAP,
+  PSL_SM_SWAP_PSS,
+  PSL_SM_ANON_HUGE_PAGES,
+  PSL_SM_MAX
+};
+
+static const struct {
+  const char *name;
+  size_t len;
+} psll__smaps_fields[PSL_SM_MAX] = {
+  { "Rss:",           4 },
+  { "Pss:",           4 },
+  { "Private_Clean:", 14 },
+  { "Private_Dirty:", 14 },
+  { "Swap:",          5 },
+  { "SwapPss:",       8 },
+  { "AnonHugePages:", 14 }
+};
+
+/* Add the fields of the complete lines of `buf` to `sm`, in bytes.
+   Returns the number of bytes used, i.e. up to the last newline. The
+   mapping header lines start with a hex address, so they never match a
+   field name. This does not call R. */
+
+static size_t psll__parse_smaps(char *buf, size_t len, double *sm) {
+  char *line = buf, *end = buf + len, *nl;
+  int i;
+
+  while (line < end && (nl = memchr(line, '\n', end - line))) {
+    if (*line >= 'A' && *line <= 'Z') {
+      for (i = 0; i < PSL_SM_MAX; i++) {
+	if (!strncmp(line, psll__smaps_fields[i].name,
+		     psll__smaps_fields[i].len)) {
+	  sm[i] += strtoull(line + psll__smaps_fields[i].len, NULL, 10) *
+	    1024.0;
+	  break;
+	}
+      }
+    }
+    line = nl + 1;
+  }
+
+  return line - buf;
+}
+
+/* Read and sum a smaps or smaps_rollup file, in chunks of `bufsize`,
+   so a large smaps file is never read into memory at once. A line that
+   does not fit into the buffer is skipped. Returns -1 and sets errno on
+   error. */
+
+static int psll__read_smaps(int fd, double *sm, char *buf, size_t bufsize) {
+  size_t have = 0, used;
+  ssize_t ret;
+
+  memset(sm, 0, PSL_SM_MAX * sizeof(double));
+
+  while ((ret = read(fd, buf + have, bufsize - 1 - have)) > 0) {
+    have += ret;
+    used = psll__parse_smaps(buf, have, sm);
+    if (used == 0 && have == bufsize - 1) used = have;
+    memmove(buf, buf + used, have - used);
+    have -= used;
+  }
+  if (ret == -1) return -1;
+
+  /* Last line, without a newline */
+  if (have > 0) {
+    buf[have] = '\n';
+    psll__parse_smaps(buf, have + 1, sm);
+  }
+
+  return 0;
+}
+
+#define PSL_SMAPS_BUFFER 65536
+
+SEXP psl__memory_full_info(SEXP p) {
+  ps_handle_t *handle = R_ExternalPtrAddr(p);
+  char path[64], *buf;
+  double sm[PSL_SM_MAX];
+  int fd, ret;
+  SEXP result, names;
+
+  if (!handle) error("Process pointer cleaned up already");
+
+  snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", (int) handle->pid);
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1 && errno == ENOENT) {
+    snprintf(path, sizeof(path), "/proc/%d/smaps", (int) handle->pid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+  }
+  if (fd == -1 && (errno == EACCES || errno == EPERM)) {
+    PS__CHECK_HANDLE(handle);
+    ps__access_denied("");
+    ps__throw_error();
+  }
+  if (fd == -1) ps__check_for_zombie(handle, 1);
+
+  buf = R_alloc(PSL_SMAPS_BUFFER, 1);
+  ret = psll__read_smaps(fd, sm, buf, PSL_SMAPS_BUFFER);
+  close(fd);
+  ps__check_for_zombie(handle, ret == -1);
+
+  PS__CHECK_HANDLE(handle);
+
+  PROTECT(result = allocVector(REALSXP, 6));
+  REAL(result)[0] = sm[PSL_SM_PRIVATE_CLEAN] + sm[PSL_SM_PRIVATE_DIRTY];
+  REAL(result)[1] = sm[PSL_SM_PSS];
+  REAL(result)[2] = sm[PSL_SM_SWAP];
+  REAL(result)[3] = sm[PSL_SM_SWAP_PSS];
+  REAL(result)[4] = sm[PSL_SM_ANON_HUGE_PAGES];
+  REAL(result)[5] = sm[PSL_SM_PRIVATE_DIRTY];
+  PROTECT(names = ps__build_string("uss", "pss", "swap", "swap_pss",
+				   "anon_huge_pages", "private_dirty", NULL));
+  setAttrib(result, R_NamesSymbol, names);
+
+  UNPROTECT(2);
+  return result;
+}
+
+/* The counters of /proc/<pid>/io, in the order of the file */
+
+enum {
+  PSL_IO_RCHAR = 0,
+  PSL_IO_WCHAR,
+  PSL_IO_SYSCR,
+  PSL_IO_SYSCW,
+  PSL_IO_READ_BYTES,
+  PSL_IO_WRITE_BYTES,
+  PSL_IO_CANCELLED_WRITE_BYTES,
+  PSL_IO_MAX
+};
+
+static const struct {
+  const char *name;
+  size_t len;
+} psll__io_fields[PSL_IO_MAX] = {
+  { "rchar:",                 6 },
+  { "wchar:",                 6 },
+  { "syscr:",                 6 },
+  { "syscw:",                 6 },
+  { "read_bytes:",            11 },
+  { "write_bytes:",           12 },
+  { "cancelled_write_bytes:", 22 }
+};
+
+/* Parse the contents of a /proc/<pid>/io file, in a single pass. The
+   counters that are missing from the file are not changed. This does
+   not call R. */
+
+static void psll__parse_io(const char *buf, double *io) {
+  const char *line = buf;
+  int i = 0;
+
+  while (*line) {
+    /* The fields are in order, so the first try usually matches */
+    int j, k;
+    for (j = 0; j < PSL_IO_MAX; j++) {
+      k = (i + j) % PSL_IO_MAX;
+      if (!strncmp(line, psll__io_fields[k].name, psll__io_fields[k].len)) {
+	io[k] = strtoull(line + psll__io_fields[k].len, NULL, 10);
+	i = k + 1;
+	break;
+      }
+    }
+    line = strchr(line, '\n');
+    if (!line) break;
+    line++;
+  }
+}
+
+SEXP psl__io_counters(SEXP p) {
+  ps_handle_t *handle = R_ExternalPtrAddr(p);
+  double io[PSL_IO_MAX];
+  char *buf;
+  int i, ret;
+  SEXP result, names;
+
+  if (!handle) error("Process pointer cleaned up already");
+
+  ret = psll__handle_file(handle, "io", &handle->oneshot.io, &buf,
+			  /* buffer= */ 1024);
+  if (ret == -1 && (errno == EACCES || errno == EPERM)) {
+    PS__CHECK_HANDLE(handle);
+    ps__access_denied("");
+    ps__throw_error();
+  }
+  ps__check_for_zombie(handle, ret <= 0);
+
+  *(buf + ret - 1) = '\0';
+  for (i = 0; i < PSL_IO_MAX; i++) io[i] = NA_REAL;
+  psll__parse_io(buf, io);
+
+  PS__CHECK_HANDLE(handle);
+
+  PROTECT(result = allocVector(REALSXP, 7));
+  REAL(result)[0] = io[PSL_IO_READ_BYTES];
+  REAL(result)[1] = io[PSL_IO_WRITE_BYTES];
+  REAL(result)[2] = io[PSL_IO_RCHAR];
+  REAL(result)[3] = io[PSL_IO_WCHAR];
+  REAL(result)[4] = io[PSL_IO_SYSCR];
+  REAL(result)[5] = io[PSL_IO_SYSCW];
+  REAL(result)[6] = io[PSL_IO_CANCELLED_WRITE_BYTES];
+  PROTECT(names = ps__build_string("read_bytes", "write_bytes", "rchar",
+				   "wchar", "syscr", "syscw",
+				   "cancelled_write_bytes", NULL));
+  setAttrib(result, R_NamesSymbol, names);
+
+  UNPROTECT(2);
+  return result;
+}
+
+SEXP ps__boot_time() {
+  if (psll_linux_boot_time == 0) {
+    if (psll_linux_get_boot_time()) {
+      ps__set_error_from_errno();
+      ps__throw_error();
     }
   }
   return ScalarReal(psll_linux_boot_time);
@@ -806,12 +1526,74 @@ SEXP ps__cpu_count_physical() {
   return R_NilValue;
 }
 
+/* Read a whole file into `*buffer`, that has `*size` bytes, and is
+   grown with realloc(), if needed. The buffer can be reused for many
+   files, and the caller needs to free() it at the end. */
+
+static ssize_t psl__read_file_reuse(const char *path, char **buffer,
+				    size_t *size) {
+  int fd, err;
+  ssize_t ret;
+  size_t len = 0;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1) return -1;
+
+  for (;;) {
+    if (!*buffer || len == *size) {
+      size_t new_size = *buffer ? *size * 2 : (*size ? *size : 4096);
+      char *new = realloc(*buffer, new_size);
+      if (!new) goto error;
+      *buffer = new;
+      *size = new_size;
+    }
+    ret = read(fd, *buffer + len, *size - len);
+    if (ret == -1) goto error;
+    if (ret == 0) break;
+    len += ret;
+  }
+
+  close(fd);
+  return len;
+
+ error:
+  err = errno;
+  close(fd);
+  errno = err;
+  return -1;
+}
+
+/* Whether the environment block has a variable called `name`. The block
+   is a sequence of NUL terminated NAME=VALUE strings, so a match must
+   start at a NUL boundary, and must be followed by '='. glibc's memmem()
+   uses the two-way algorithm, and a vectorized search for the first
+   bytes of the needle, this is much faster than memchr() + memcmp() for
+   large environments. */
+
+static int psl__environ_has(const char *env, size_t len, const char *name,
+			    size_t name_len) {
+  const char *ptr = env, *end = env + len, *hit;
+  if (name_len == 0) return 0;
+  while (ptr < end && (hit = memmem(ptr, end - ptr, name, name_len))) {
+    if ((hit == env || hit[-1] == '\0') &&
+	hit + name_len < end && hit[name_len] == '=') {
+      return 1;
+    }
+    ptr = hit + 1;
+  }
+  return 0;
+}
+
+/* Reused for every environ file, it is only freed when R exits */
+
+static char *psl__environ_buf = NULL;
+static size_t psl__environ_size = 0;
+
 static int psl__linux_match_environ(SEXP r_marker, SEXP r_pid) {
   const char *marker = CHAR(STRING_ELT(r_marker, 0));
   pid_t pid = INTEGER(r_pid)[0];
   char path[512];
-  int ret;
-  char *buf;
+  ssize_t ret;
 
   ret = snprintf(path, sizeof(path), "/proc/%d/environ", (int) pid);
   if (ret >= sizeof(path)) {
@@ -822,13 +1604,29 @@ static int psl__linux_match_environ(SEXP r_marker, SEXP r_pid) {
     return -1;
   }
 
-  ret = ps__read_file(path, &buf, /* buffer= */ 1024 * 32);
+  ret = psl__read_file_reuse(path, &psl__environ_buf, &psl__environ_size);
   if (ret == -1) {
     ps__set_error_from_errno();
     return -1;
   }
 
-  return ps__memmem(buf, ret, marker, strlen(marker)) != NULL;
+  return psl__environ_has(psl__environ_buf, ret, marker, strlen(marker));
+}
+
+/* Processes that started before the marker was created cannot have
+   it, so their environment is not read, like in psl__find_tree(). If
+   the stat file cannot be read, then reading the environment reports
+   the error. */
+
+static int psl__started_before(pid_t pid, SEXP r_after) {
+  double after = REAL(r_after)[0];
+  psl_stat_t stat;
+
+  if (ISNAN(after)) return 0;
+  if (psll_linux_init_time()) ps__throw_error();
+  if (psll__parse_stat_file(pid, &stat, 0)) return 0;
+  return psll_linux_boot_time + stat.starttime * psll_linux_clock_period <
+    after - 1;
 }
 
 SEXP ps__kill_if_env(SEXP r_marker, SEXP r_after, SEXP r_pid, SEXP r_sig) {
@@ -838,6 +1636,8 @@ SEXP ps__kill_if_env(SEXP r_marker, SEXP r_after, SEXP r_pid, SEXP r_sig) {
   int ret;
   int match;
 
+  if (psl__started_before(pid, r_after)) return R_NilValue;
+
   match = psl__linux_match_environ(r_marker, r_pid);
 
   if (match == -1) ps__throw_error();
@@ -873,6 +1673,8 @@ SEXP ps__find_if_env(SEXP r_marker, SEXP r_after, SEXP r_pid) {
   int match;
   ps_handle_t *handle;
 
+  if (psl__started_before(INTEGER(r_pid)[0], r_after)) return R_NilValue;
+
   PROTECT(phandle = psll_handle(r_pid,  R_NilValue));
   handle = R_ExternalPtrAddr(phandle);
 
@@ -1095,3 +1897,2918 @@ SEXP ps__users() {
   UNPROTECT(1);
   return result;
 }
+
+/* ---------------------------------------------------------------------*/
+/* Process table snapshot                                               */
+/* ---------------------------------------------------------------------*/
+
+/* A snapshot reads /proc once, and parses every file of a process at
+   most once. The scanning code below does not call R, it fills plain
+   C structs, and the R vectors are only created at the end.
+
+   Every column declares the /proc files it needs, and only the files
+   needed by the requested columns are opened. */
+
+#define PSL_NAME_LEN 128
+#define PSL_SCAN_BUFFER 8192
+
+#define PSL_FILE_STAT    (1 << 0)
+#define PSL_FILE_STATM   (1 << 1)
+#define PSL_FILE_STATUS  (1 << 2)
+#define PSL_FILE_CMDLINE (1 << 3)
+#define PSL_FILE_EXE     (1 << 4)
+#define PSL_FILE_FD      (1 << 5)
+#define PSL_FILE_IO      (1 << 6)
+/* Not a file: keep the processes that finish while we read them, and
+   record the errors in the `error` column */
+#define PSL_FILE_ERROR   (1 << 7)
+#define PSL_FILE_SMAPS   (1 << 8)
+
+typedef enum {
+  PSL_COL_PID = 0,
+  PSL_COL_PPID,
+  PSL_COL_NAME,
+  PSL_COL_UID,
+  PSL_COL_USERNAME,
+  PSL_COL_STATUS,
+  PSL_COL_USER,
+  PSL_COL_SYSTEM,
+  PSL_COL_RSS,
+  PSL_COL_VMS,
+  PSL_COL_CREATED,
+  PSL_COL_PS_HANDLE,
+  PSL_COL_CMDLINE,
+  PSL_COL_EXE,
+  PSL_COL_NUM_FDS,
+  PSL_COL_READ_BYTES,
+  PSL_COL_WRITE_BYTES,
+  PSL_COL_RCHAR,
+  PSL_COL_WCHAR,
+  PSL_COL_SYSCR,
+  PSL_COL_SYSCW,
+  PSL_COL_CANCELLED_WRITE_BYTES,
+  PSL_COL_NICE,
+  PSL_COL_PROCESSOR,
+  PSL_COL_RT_PRIORITY,
+  PSL_COL_POLICY,
+  PSL_COL_BLKIO_TIME,
+  PSL_COL_GUEST_TIME,
+  PSL_COL_PSS,
+  PSL_COL_ERROR,
+  PSL_COL_MAX
+} psl_column_t;
+
+static const struct {
+  const char *name;
+  int files;
+} psl__columns[PSL_COL_MAX] = {
+  { "pid",         0                },
+  { "ppid",        PSL_FILE_STAT    },
+  { "name",        PSL_FILE_STAT    },
+  { "uid",         PSL_FILE_STATUS  },
+  { "username",    PSL_FILE_STATUS  },
+  { "status",      PSL_FILE_STAT    },
+  { "user",        PSL_FILE_STAT    },
+  { "system",      PSL_FILE_STAT    },
+  { "rss",         PSL_FILE_STATM   },
+  { "vms",         PSL_FILE_STATM   },
+  { "created",     PSL_FILE_STAT    },
+  { "ps_handle",   PSL_FILE_STAT    },
+  { "cmdline",     PSL_FILE_CMDLINE },
+  { "exe",         PSL_FILE_EXE     },
+  { "num_fds",     PSL_FILE_FD      },
+  { "read_bytes",  PSL_FILE_IO      },
+  { "write_bytes", PSL_FILE_IO      },
+  { "rchar",       PSL_FILE_IO      },
+  { "wchar",       PSL_FILE_IO      },
+  { "syscr",       PSL_FILE_IO      },
+  { "syscw",       PSL_FILE_IO      },
+  { "cancelled_write_bytes", PSL_FILE_IO },
+  { "nice",        PSL_FILE_STAT    },
+  { "processor",   PSL_FILE_STAT    },
+  { "rt_priority", PSL_FILE_STAT    },
+  { "policy",      PSL_FILE_STAT    },
+  { "blkio_time",  PSL_FILE_STAT    },
+  { "guest_time",  PSL_FILE_STAT    },
+  { "pss",         PSL_FILE_SMAPS   },
+  { "error",       PSL_FILE_STAT | PSL_FILE_ERROR }
+};
+
+typedef struct {
+  pid_t pid;
+  int ppid;
+  char state;
+  int uid;
+  unsigned long utime, stime;
+  double rss, vms;
+  unsigned long long starttime;
+  char name[PSL_NAME_LEN];
+  char *cmdline;
+  ssize_t cmdline_len;
+  char *exe;
+  int num_fds;
+  double io[PSL_IO_MAX];
+  long stat_rss;
+  int nice, processor;
+  unsigned int rt_priority, policy;
+  unsigned long long blkio_ticks;
+  unsigned long guest_time;
+  double pss;
+  int error;
+  int skip;
+} psl_proc_t;
+
+typedef struct {
+  size_t num;
+  psl_proc_t *procs;
+} psl_snapshot_t;
+
+ssize_t ps__read_file_buf(const char *path, char *buffer,
+			  size_t buffer_size);
+
+typedef struct ps__uring_s ps__uring_t;
+ps__uring_t *ps__uring_new(unsigned entries);
+void ps__uring_free(ps__uring_t *ring);
+int ps__uring_read_files(ps__uring_t *ring, size_t num, const char **paths,
+			 char **buffers, size_t buffer_size, ssize_t *lens);
+
+/* The small /proc files that can be read in a batch, with io_uring,
+   before scanning the processes. */
+
+enum {
+  PSL_PRE_STAT = 0,
+  PSL_PRE_STATM,
+  PSL_PRE_STATUS,
+  PSL_PRE_IO,
+  PSL_PRE_MAX
+};
+
+static const struct {
+  const char *file;
+  int flag;
+} psl__prefiles[PSL_PRE_MAX] = {
+  { "stat",   PSL_FILE_STAT   },
+  { "statm",  PSL_FILE_STATM  },
+  { "status", PSL_FILE_STATUS },
+  { "io",     PSL_FILE_IO     }
+};
+
+/* 4k is plenty, we only need the beginning of the status file */
+#define PSL_PRE_BUFFER 4096
+
+typedef struct {
+  char *data[PSL_PRE_MAX];
+  ssize_t len[PSL_PRE_MAX];
+} psl_prefetch_t;
+
+/* Read one of the small files, either from the prefetched data, or
+   synchronously, into `buf`. Returns the length, or -1 and sets errno. */
+
+static ssize_t psl__read_proc_file(pid_t pid, int which,
+				   const psl_prefetch_t *pre,
+				   char *buf, size_t bufsize, char **data) {
+  char path[64];
+  if (pre && pre->data[which]) {
+    *data = pre->data[which];
+    if (pre->len[which] < 0) {
+      errno = - pre->len[which];
+      return -1;
+    }
+    return pre->len[which];
+  }
+  snprintf(path, sizeof(path), "/proc/%d/%s", (int) pid,
+	   psl__prefiles[which].file);
+  *data = buf;
+  return ps__read_file_buf(path, buf, bufsize);
+}
+
+static const char *psl__status_name(char state) {
+  switch (state) {
+  case 'R': return "running";
+  case 'S': return "sleeping";
+  case 'D': return "disk_sleep";
+  case 'T': return "stopped";
+  case 't': return "tracing_stop";
+  case 'Z': return "zombie";
+  case 'X': return "dead";
+  case 'x': return "dead";
+  case 'K': return "wake_kill";
+  case 'W': return "waking";
+  default:  return NULL;
+  }
+}
+
+/* The SCHED_* constants of sched_setscheduler(2) */
+
+static const char *psl__policy_name(unsigned int policy) {
+  switch (policy) {
+  case 0: return "normal";
+  case 1: return "fifo";
+  case 2: return "rr";
+  case 3: return "batch";
+  case 5: return "idle";
+  case 6: return "deadline";
+  default: return NULL;
+  }
+}
+
+static void psl__snapshot_free(psl_snapshot_t *snap) {
+  size_t i;
+  if (!snap) return;
+  if (snap->procs) {
+    for (i = 0; i < snap->num; i++) {
+      free(snap->procs[i].cmdline);
+      free(snap->procs[i].exe);
+    }
+    free(snap->procs);
+  }
+  free(snap);
+}
+
+static void psl__snapshot_finalizer(SEXP x) {
+  psl__snapshot_free(R_ExternalPtrAddr(x));
+  R_ClearExternalPtr(x);
+}
+
+/* All numeric entries of /proc, in a malloc()-ed array. We call
+   getdents64 directly, with a large buffer, and parse the pids from the
+   directory entries, without creating strings. */
+
+#define PSL_DIRENT_BUFFER (128 * 1024)
+
+struct psl_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+static int psl__list_pids(pid_t **pids, size_t *num) {
+  int fd = -1;
+  char *buf = NULL;
+  size_t size = 1024;
+  long nread, pos;
+
+  *num = 0;
+  *pids = malloc(size * sizeof(pid_t));
+  buf = malloc(PSL_DIRENT_BUFFER);
+  if (!*pids || !buf) goto error;
+
+  fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) goto error;
+
+  while (1) {
+    nread = syscall(SYS_getdents64, fd, buf, PSL_DIRENT_BUFFER);
+    if (nread == -1) goto error;
+    if (nread == 0) break;
+    for (pos = 0; pos < nread; ) {
+      struct psl_dirent64 *d = (struct psl_dirent64 *) (buf + pos);
+      const char *c = d->d_name;
+      long pid = 0;
+      pos += d->d_reclen;
+      if (*c < '0' || *c > '9') continue;
+      while (*c >= '0' && *c <= '9') pid = pid * 10 + (*c++ - '0');
+      if (*c) continue;
+      if (*num == size) {
+	pid_t *new = realloc(*pids, size * 2 * sizeof(pid_t));
+	if (!new) goto error;
+	*pids = new;
+	size *= 2;
+      }
+      (*pids)[(*num)++] = pid;
+    }
+  }
+
+  close(fd);
+  free(buf);
+  return 0;
+
+ error:
+  if (fd != -1) close(fd);
+  free(buf);
+  free(*pids);
+  *pids = NULL;
+  return -1;
+}
+
+static int psl__cmp_pid(const void *a, const void *b) {
+  pid_t pa = *(const pid_t*) a, pb = *(const pid_t*) b;
+  return (pa > pb) - (pa < pb);
+}
+
+SEXP psl__pids(SEXP sort) {
+  pid_t *pids;
+  size_t i, num;
+  SEXP result;
+
+  if (psl__list_pids(&pids, &num)) {
+    ps__set_error_from_errno();
+    ps__throw_error();
+  }
+  PROTECT_PTR(pids);
+
+  /* The kernel lists the pids in increasing order, so usually there is
+     nothing to do here. */
+  if (LOGICAL(sort)[0]) {
+    for (i = 1; i < num; i++) if (pids[i - 1] > pids[i]) break;
+    if (i < num) qsort(pids, num, sizeof(pid_t), psl__cmp_pid);
+  }
+
+  PROTECT(result = allocVector(INTSXP, num));
+  for (i = 0; i < num; i++) INTEGER(result)[i] = pids[i];
+
+  UNPROTECT(2);
+  return result;
+}
+
+SEXP ps__pids() {
+  SEXP sort, result;
+  PROTECT(sort = ScalarLogical(1));
+  PROTECT(result = psl__pids(sort));
+  UNPROTECT(2);
+  return result;
+}
+
+/* Read a whole file into a malloc()-ed buffer. Unlike
+   ps__read_file() it does not use the R heap. */
+
+static ssize_t psl__read_file_alloc(const char *path, char **buffer) {
+  size_t size = 0;
+  ssize_t ret;
+  int err;
+
+  *buffer = NULL;
+  ret = psl__read_file_reuse(path, buffer, &size);
+  if (ret == -1) {
+    err = errno;
+    free(*buffer);
+    *buffer = NULL;
+    errno = err;
+  }
+  return ret;
+}
+
+/* Can be set to another file in the R_PS_SMAPS_ROLLUP environment
+   variable, to test the kernels that do not have smaps_rollup. */
+
+static const char *psl__smaps_file = "smaps_rollup";
+
+static int psl__gone(void) {
+  return errno == ENOENT || errno == ESRCH;
+}
+
+/* A file of the process could not be read. Record the first error, and
+   return 1 if the process is gone, and should be dropped. */
+
+static int psl__scan_failed(psl_proc_t *proc, int files) {
+  int gone = psl__gone();
+  if (!proc->error) proc->error = ps__error_code_from_errno(errno);
+  return gone && !(files & PSL_FILE_ERROR);
+}
+
+/* Long names are truncated to 15 characters in the stat file. Like
+   ps_name(), use the file name of the executable from the command
+   line instead, if it starts with the truncated name. */
+
+static void psl__scan_long_name(psl_proc_t *proc, char *buf,
+				size_t bufsize) {
+  char path[64];
+  ssize_t ret;
+  char *base;
+
+  if (proc->cmdline) {
+    if (proc->cmdline_len <= 0) return;
+    ret = proc->cmdline_len < bufsize ? proc->cmdline_len : bufsize - 1;
+    memcpy(buf, proc->cmdline, ret);
+    buf[ret] = '\0';
+  } else {
+    snprintf(path, sizeof(path), "/proc/%d/cmdline", (int) proc->pid);
+    ret = ps__read_file_buf(path, buf, bufsize);
+    if (ret <= 0) return;
+  }
+
+  base = strrchr(buf, '/');
+  base = base ? base + 1 : buf;
+  if (!strncmp(base, proc->name, strlen(proc->name))) {
+    strncpy(proc->name, base, PSL_NAME_LEN - 1);
+    proc->name[PSL_NAME_LEN - 1] = '\0';
+  }
+}
+
+static int psl__scan_num_fds(pid_t pid) {
+  char path[64];
+  DIR *dir;
+  struct dirent *entry;
+  int num = 0;
+
+  snprintf(path, sizeof(path), "/proc/%d/fd", (int) pid);
+  dir = opendir(path);
+  if (!dir) return -1;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] != '.') num++;
+  }
+  closedir(dir);
+  return num;
+}
+
+/* Predicates that are evaluated while scanning, so the processes that
+   do not match are dropped before reading the more expensive files.
+   The cheap ones come first: the effective uid is the owner of the
+   /proc/<pid> directory, the start time, the parent and the kernel
+   thread flag are in the stat file. The command line is only read for
+   the processes that pass all other predicates. */
+
+#define PSL_PF_KTHREAD 0x00200000
+
+typedef struct {
+  int files;
+  int none;
+  int has_ruid, has_euid, has_after, has_name, has_cmdline;
+  int kthreads;
+  uid_t ruid, euid;
+  double after;
+  const int *ppids;
+  int nppids;
+  regex_t name, cmdline;
+} psl_filter_t;
+
+static void psl__filter_finalizer(SEXP x) {
+  psl_filter_t *filter = R_ExternalPtrAddr(x);
+  if (!filter) return;
+  if (filter->has_name) regfree(&filter->name);
+  if (filter->has_cmdline) regfree(&filter->cmdline);
+  free(filter);
+  R_ClearExternalPtr(x);
+}
+
+static SEXP psl__filter_elt(SEXP filter, const char *name) {
+  SEXP names = getAttrib(filter, R_NamesSymbol);
+  int i, n = isNull(names) ? 0 : LENGTH(filter);
+  for (i = 0; i < n; i++) {
+    if (!strcmp(CHAR(STRING_ELT(names, i)), name)) {
+      return VECTOR_ELT(filter, i);
+    }
+  }
+  return R_NilValue;
+}
+
+static void psl__filter_regex(regex_t *re, int *has, SEXP pattern) {
+  char msg[256];
+  int ret = regcomp(re, CHAR(STRING_ELT(pattern, 0)),
+		    REG_EXTENDED | REG_NOSUB);
+  if (ret) {
+    regerror(ret, re, msg, sizeof(msg));
+    ps__set_error("Invalid regular expression: %s", msg);
+    ps__throw_error();
+  }
+  *has = 1;
+}
+
+static uid_t psl__filter_user(psl_filter_t *filter, SEXP user) {
+  struct passwd *pwd = getpwnam(CHAR(STRING_ELT(user, 0)));
+  if (!pwd) {
+    filter->none = 1;
+    return 0;
+  }
+  return pwd->pw_uid;
+}
+
+/* `filter` is a named list, the entries are all optional. `user` is a
+   user name for the real uid, `euser` and `euid` are for the effective
+   uid. The result is an external pointer, or NULL for no filter. */
+
+static SEXP psl__filter_new(SEXP filter) {
+  psl_filter_t *f;
+  SEXP pf, elt;
+
+  if (isNull(filter) || LENGTH(filter) == 0) return R_NilValue;
+
+  f = calloc(1, sizeof(psl_filter_t));
+  if (!f) {
+    ps__no_memory("");
+    ps__throw_error();
+  }
+  PROTECT(pf = R_MakeExternalPtr(f, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(pf, psl__filter_finalizer, 1);
+
+  if (!isNull(elt = psl__filter_elt(filter, "user"))) {
+    f->has_ruid = 1;
+    f->ruid = psl__filter_user(f, elt);
+    f->files |= PSL_FILE_STATUS;
+  }
+  if (!isNull(elt = psl__filter_elt(filter, "euser"))) {
+    f->has_euid = 1;
+    f->euid = psl__filter_user(f, elt);
+  }
+  if (!isNull(elt = psl__filter_elt(filter, "euid"))) {
+    uid_t euid = INTEGER(elt)[0];
+    if (f->has_euid && f->euid != euid) f->none = 1;
+    f->has_euid = 1;
+    f->euid = euid;
+  }
+  if (!isNull(elt = psl__filter_elt(filter, "after"))) {
+    f->has_after = 1;
+    f->after = REAL(elt)[0];
+    f->files |= PSL_FILE_STAT;
+  }
+  if (!isNull(elt = psl__filter_elt(filter, "ppid"))) {
+    f->ppids = INTEGER(elt);
+    f->nppids = LENGTH(elt);
+    f->files |= PSL_FILE_STAT;
+  }
+  if (!isNull(elt = psl__filter_elt(filter, "kthreads"))) {
+    f->kthreads = LOGICAL(elt)[0];
+    f->files |= PSL_FILE_STAT;
+  }
+  if (!isNull(elt = psl__filter_elt(filter, "name"))) {
+    psl__filter_regex(&f->name, &f->has_name, elt);
+    f->files |= PSL_FILE_STAT;
+  }
+  if (!isNull(elt = psl__filter_elt(filter, "cmdline"))) {
+    psl__filter_regex(&f->cmdline, &f->has_cmdline, elt);
+    f->files |= PSL_FILE_CMDLINE;
+  }
+
+  UNPROTECT(1);
+  return pf;
+}
+
+static int psl__filter_stat(const psl_filter_t *filter,
+			    const psl_stat_t *pstat) {
+  int i;
+  if (filter->kthreads && (pstat->flags & PSL_PF_KTHREAD)) return 0;
+  if (filter->has_after &&
+      psll_linux_boot_time + pstat->starttime * psll_linux_clock_period <
+      filter->after) {
+    return 0;
+  }
+  if (filter->ppids) {
+    for (i = 0; i < filter->nppids; i++) {
+      if (filter->ppids[i] == pstat->ppid) break;
+    }
+    if (i == filter->nppids) return 0;
+  }
+  return 1;
+}
+
+/* The arguments are separated by spaces, like in the output of ps. */
+
+static int psl__filter_cmdline(const psl_filter_t *filter,
+			       const char *cmdline, ssize_t len) {
+  char *str;
+  ssize_t i;
+  int ret;
+
+  if (len <= 0) return 0;
+  str = malloc(len + 1);
+  if (!str) return 0;
+  memcpy(str, cmdline, len);
+  str[len] = '\0';
+  while (len > 0 && !str[len - 1]) len--;
+  for (i = 0; i < len; i++) if (!str[i]) str[i] = ' ';
+  ret = !regexec(&filter->cmdline, str, 0, NULL, 0);
+  free(str);
+  return ret;
+}
+
+/* Returns -1 if the process is gone, in this case it should be left out
+   from the snapshot. Returns 1 if the process does not match `filter`,
+   and it should be left out as well. If the process exists, but a file
+   cannot be read, e.g. because of missing permissions, that results
+   missing values. */
+
+static int psl__scan_pid(pid_t pid, int files, psl_proc_t *proc,
+			 char *buf, size_t bufsize,
+			 const psl_prefetch_t *pre,
+			 const psl_filter_t *filter) {
+  char path[PATH_MAX];
+  psl_stat_t pstat;
+  char *data, *name, *hit;
+  ssize_t ret;
+  unsigned long rss, vms;
+  int i, long_name = 0;
+
+  memset(proc, 0, sizeof(psl_proc_t));
+  proc->pid = pid;
+  proc->uid = -1;
+  proc->rss = proc->vms = NA_REAL;
+  proc->num_fds = NA_INTEGER;
+  for (i = 0; i < PSL_IO_MAX; i++) proc->io[i] = NA_REAL;
+  proc->pss = NA_REAL;
+  proc->cmdline_len = -1;
+
+  if (filter && filter->has_euid) {
+    struct stat st;
+    snprintf(path, sizeof(path), "/proc/%d", (int) pid);
+    if (stat(path, &st)) return -1;
+    if (st.st_uid != filter->euid) return 1;
+  }
+
+  if (files & PSL_FILE_STAT) {
+    ret = psl__read_proc_file(pid, PSL_PRE_STAT, pre, buf, bufsize, &data);
+    if (ret <= 0) return -1;
+    if (psll__parse_stat(data, &pstat, &name)) return -1;
+    if (filter && !psl__filter_stat(filter, &pstat)) return 1;
+
+    proc->ppid = pstat.ppid;
+    proc->state = pstat.state;
+    proc->utime = pstat.utime;
+    proc->stime = pstat.stime;
+    proc->starttime = pstat.starttime;
+    proc->stat_rss = pstat.rss;
+    proc->nice = pstat.nice;
+    proc->processor = pstat.processor;
+    proc->rt_priority = pstat.rt_priority;
+    proc->policy = pstat.policy;
+    proc->blkio_ticks = pstat.delayacct_blkio_ticks;
+    proc->guest_time = pstat.guest_time;
+    strncpy(proc->name, name, PSL_NAME_LEN - 1);
+    proc->name[PSL_NAME_LEN - 1] = '\0';
+    if (pstat.state == 'Z') proc->error = PS__ZOMBIE_PROCESS;
+
+    if (filter && filter->has_name) {
+      if (strlen(proc->name) >= 15) {
+	psl__scan_long_name(proc, buf, bufsize);
+	long_name = 1;
+      }
+      if (regexec(&filter->name, proc->name, 0, NULL, 0)) return 1;
+    }
+  }
+
+  if (files & PSL_FILE_STATUS) {
+    ret = psl__read_proc_file(pid, PSL_PRE_STATUS, pre, buf, bufsize,
+			      &data);
+    if (ret == -1 && psl__scan_failed(proc, files)) return -1;
+    if (ret > 0 && (hit = strstr(data, "\nUid:")) != NULL) {
+      sscanf(hit + 5, " %d", &proc->uid);
+    }
+    if (filter && filter->has_ruid && proc->uid != (int) filter->ruid) {
+      return 1;
+    }
+  }
+
+  if (files & PSL_FILE_CMDLINE) {
+    snprintf(path, sizeof(path), "/proc/%d/cmdline", (int) pid);
+    proc->cmdline_len = psl__read_file_alloc(path, &proc->cmdline);
+    if (proc->cmdline_len == -1 && psl__scan_failed(proc, files)) {
+      return -1;
+    }
+    if (filter && filter->has_cmdline &&
+	!psl__filter_cmdline(filter, proc->cmdline, proc->cmdline_len)) {
+      return 1;
+    }
+  }
+
+  if (files & PSL_FILE_STATM) {
+    ret = psl__read_proc_file(pid, PSL_PRE_STATM, pre, buf, bufsize, &data);
+    if (ret == -1 && psl__scan_failed(proc, files)) return -1;
+    if (ret > 0 && sscanf(data, "%lu %lu", &rss, &vms) == 2) {
+      proc->rss = rss;
+      proc->vms = vms;
+    }
+  }
+
+  if (files & PSL_FILE_EXE) {
+    snprintf(path, sizeof(path), "/proc/%d/exe", (int) pid);
+    ret = readlink(path, buf, bufsize - 1);
+    if (ret > 0) {
+      char *dpos;
+      struct stat st;
+      buf[ret] = '\0';
+      /* See psll__readlink() */
+      if ((dpos = strstr(buf, " (deleted)")) != NULL &&
+	  !strcmp(dpos, " (deleted)") && !stat(buf, &st)) {
+	*dpos = '\0';
+      }
+      proc->exe = strdup(buf);
+    } else if (ret == -1 && errno != ENOENT) {
+      /* ENOENT is a kernel thread, or a zombie, these have no exe */
+      psl__scan_failed(proc, files);
+    }
+  }
+
+  if (files & PSL_FILE_FD) {
+    proc->num_fds = psl__scan_num_fds(pid);
+    if (proc->num_fds == -1) {
+      if (psl__scan_failed(proc, files)) return -1;
+      proc->num_fds = NA_INTEGER;
+    }
+  }
+
+  if (files & PSL_FILE_IO) {
+    ret = psl__read_proc_file(pid, PSL_PRE_IO, pre, buf, bufsize, &data);
+    if (ret == -1 && psl__scan_failed(proc, files)) return -1;
+    if (ret > 0) psll__parse_io(data, proc->io);
+  }
+
+  /* Only smaps_rollup, which is summed up by the kernel, the full smaps
+     file would be too slow for every process. Opening it fails with
+     ENOENT on Linux before 4.14, which does not have smaps_rollup, and
+     with ESRCH for kernel threads. Then pss is NA, and this is not an
+     error, unless the process is gone. */
+  if (files & PSL_FILE_SMAPS) {
+    int fd;
+    snprintf(path, sizeof(path), "/proc/%d/%s", (int) pid, psl__smaps_file);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 && psl__gone()) {
+      snprintf(path, sizeof(path), "/proc/%d", (int) pid);
+      if (access(path, F_OK) && psl__scan_failed(proc, files)) return -1;
+    } else if (fd == -1) {
+      if (psl__scan_failed(proc, files)) return -1;
+    } else {
+      double sm[PSL_SM_MAX];
+      if (!psll__read_smaps(fd, sm, buf, bufsize)) proc->pss = sm[PSL_SM_PSS];
+      close(fd);
+    }
+  }
+
+  if ((files & PSL_FILE_STAT) && !long_name && strlen(proc->name) >= 15) {
+    psl__scan_long_name(proc, buf, bufsize);
+  }
+
+  return 0;
+}
+
+static SEXP psl__cmdline_vector(const char *buf, ssize_t len) {
+  const char *ptr, *prev, *end = buf + len;
+  int nstr = 0;
+  SEXP result;
+
+  if (len <= 0) return ScalarString(NA_STRING);
+
+  /* Same as psll_cmdline(), without the trailing zero */
+  for (ptr = buf; ptr < end; ptr++) if (!*ptr) nstr++;
+  if (buf[len - 1]) nstr++;
+
+  PROTECT(result = allocVector(STRSXP, nstr));
+  for (ptr = prev = buf, nstr = 0; ptr < end; ptr++) {
+    if (!*ptr) {
+      SET_STRING_ELT(result, nstr++, mkCharLen(prev, ptr - prev));
+      prev = ptr + 1;
+    }
+  }
+  if (buf[len - 1]) {
+    SET_STRING_ELT(result, nstr, mkCharLen(prev, end - prev));
+  }
+
+  UNPROTECT(1);
+  return result;
+}
+
+static SEXP psl__snapshot_column(psl_column_t col, psl_snapshot_t *snap,
+				 SEXP uid) {
+  size_t i, num = snap->num;
+  psl_proc_t *procs = snap->procs;
+  SEXP result = R_NilValue;
+
+  switch (col) {
+  case PSL_COL_PID:
+    PROTECT(result = allocVector(INTSXP, num));
+    for (i = 0; i < num; i++) INTEGER(result)[i] = procs[i].pid;
+    break;
+  case PSL_COL_PPID:
+    PROTECT(result = allocVector(INTSXP, num));
+    for (i = 0; i < num; i++) INTEGER(result)[i] = procs[i].ppid;
+    break;
+  case PSL_COL_NAME:
+    PROTECT(result = allocVector(STRSXP, num));
+    for (i = 0; i < num; i++) {
+      SET_STRING_ELT(result, i, mkChar(procs[i].name));
+    }
+    break;
+  case PSL_COL_UID:
+    PROTECT(result = allocVector(INTSXP, num));
+    for (i = 0; i < num; i++) {
+      INTEGER(result)[i] = procs[i].uid == -1 ? NA_INTEGER : procs[i].uid;
+    }
+    break;
+  case PSL_COL_USERNAME:
+    PROTECT(result = ps__usernames(uid));
+    break;
+  case PSL_COL_STATUS:
+    PROTECT(result = allocVector(STRSXP, num));
+    for (i = 0; i < num; i++) {
+      const char *st = psl__status_name(procs[i].state);
+      SET_STRING_ELT(result, i, st ? mkChar(st) : NA_STRING);
+    }
+    break;
+  case PSL_COL_USER:
+    PROTECT(result = allocVector(REALSXP, num));
+    for (i = 0; i < num; i++) {
+      REAL(result)[i] = procs[i].utime * psll_linux_clock_period;
+    }
+    break;
+  case PSL_COL_SYSTEM:
+    PROTECT(result = allocVector(REALSXP, num));
+    for (i = 0; i < num; i++) {
+      REAL(result)[i] = procs[i].stime * psll_linux_clock_period;
+    }
+    break;
+  case PSL_COL_RSS:
+    PROTECT(result = allocVector(REALSXP, num));
+    for (i = 0; i < num; i++) REAL(result)[i] = procs[i].rss;
+    break;
+  case PSL_COL_VMS:
+    PROTECT(result = allocVector(REALSXP, num));
+    for (i = 0; i < num; i++) REAL(result)[i] = procs[i].vms;
+    break;
+  case PSL_COL_CREATED:
+    PROTECT(result = allocVector(REALSXP, num));
+    for (i = 0; i < num; i++) {
+      REAL(result)[i] = psll_linux_boot_time +
+	procs[i].starttime * psll_linux_clock_period;
+    }
+    break;
+  case PSL_COL_PS_HANDLE:
+    PROTECT(result = allocVector(VECSXP, num));
+    for (i = 0; i < num; i++) {
+      double ctime = psll_linux_boot_time +
+	procs[i].starttime * psll_linux_clock_period;
+      SET_VECTOR_ELT(result, i, psll__handle(procs[i].pid, ctime));
+    }
+    break;
+  case PSL_COL_CMDLINE:
+    PROTECT(result = allocVector(VECSXP, num));
+    for (i = 0; i < num; i++) {
+      SET_VECTOR_ELT(
+        result, i,
+	psl__cmdline_vector(procs[i].cmdline, procs[i].cmdline_len));
+    }
+    break;
+  case PSL_COL_EXE:
+    PROTECT(result = allocVector(STRSXP, num));
+    for (i = 0; i < num; i++) {
+      SET_STRING_ELT(
+        result, i, procs[i].exe ? mkChar(procs[i].exe) : NA_STRING);
+    }
+    break;
+  case PSL_COL_NUM_FDS:
+    PROTECT(result = allocVector(INTSXP, num));
+    for (i = 0; i < num; i++) INTEGER(result)[i] = procs[i].num_fds;
+    break;
+  case PSL_COL_READ_BYTES:
+    PROTECT(result = allocVector(REALSXP, num));
+    for (i = 0; i < num; i++) {
+      REAL(result)[i] = procs[i].io[PSL_IO_READ_BYTES];
+    }
+    break;
+  case PSL_COL_WRITE_BYTES:
+    PROTECT(result = allocVector(REALSXP, num));
+    for (i = 0; i < num; i++) {
+      REAL(result)[i] = procs[i].io[PSL_IO_WRITE_BYTES];
+    }
+    break;
+  case PSL_COL_RCHAR:
+  case PSL_COL_WCHAR:
+  case PSL_COL_SYSCR:
+  case PSL_COL_SYSCW:
+  case PSL_COL_CANCELLED_WRITE_BYTES: {
+    int which = col == PSL_COL_RCHAR ? PSL_IO_RCHAR :
+      col == PSL_COL_WCHAR ? PSL_IO_WCHAR :
+      col == PSL_COL_SYSCR ? PSL_IO_SYSCR :
+      col == PSL_COL_SYSCW ? PSL_IO_SYSCW : PSL_IO_CANCELLED_WRITE_BYTES;
+    PROTECT(result = allocVector(REALSXP, num));
+    for (i = 0; i < num; i++) REAL(result)[i] = procs[i].io[which];
+    break;
+  }
+  case PSL_COL_NICE:
+    PROTECT(result = allocVector(INTSXP, num));
+    for (i = 0; i < num; i++) INTEGER(result)[i] = procs[i].nice;
+    break;
+  case PSL_COL_PROCESSOR:
+    PROTECT(result = allocVector(INTSXP, num));
+    for (i = 0; i < num; i++) INTEGER(result)[i] = procs[i].processor;
+    break;
+  case PSL_COL_RT_PRIORITY:
+    PROTECT(result = allocVector(INTSXP, num));
+    for (i = 0; i < num; i++) INTEGER(result)[i] = procs[i].rt_priority;
+    break;
+  case PSL_COL_POLICY:
+    PROTECT(result = allocVector(STRSXP, num));
+    for (i = 0; i < num; i++) {
+      const char *pol = psl__policy_name(procs[i].policy);
+      SET_STRING_ELT(result, i, pol ? mkChar(pol) : NA_STRING);
+    }
+    break;
+  case PSL_COL_BLKIO_TIME:
+    PROTECT(result = allocVector(REALSXP, num));
+    for (i = 0; i < num; i++) {
+      REAL(result)[i] = procs[i].blkio_ticks * psll_linux_clock_period;
+    }
+    break;
+  case PSL_COL_GUEST_TIME:
+    PROTECT(result = allocVector(REALSXP, num));
+    for (i = 0; i < num; i++) {
+      REAL(result)[i] = procs[i].guest_time * psll_linux_clock_period;
+    }
+    break;
+  case PSL_COL_PSS:
+    PROTECT(result = allocVector(REALSXP, num));
+    for (i = 0; i < num; i++) REAL(result)[i] = procs[i].pss;
+    break;
+  case PSL_COL_ERROR:
+    PROTECT(result = allocVector(STRSXP, num));
+    for (i = 0; i < num; i++) {
+      SET_STRING_ELT(result, i, ps__error_code_string(procs[i].error));
+    }
+    break;
+  default:
+    error("Unknown snapshot column");
+  }
+
+  UNPROTECT(1);
+  return result;
+}
+
+/* Scanning many processes is mostly waiting for the kernel, so it can
+   be done in parallel, from a pool of worker threads. The workers take
+   chunks of the pid list, and fill the (preallocated) slot of each pid.
+   The workers do not call R at all. */
+
+#define PSL_SCAN_CHUNK 64
+
+typedef struct {
+  pid_t *pids;
+  size_t num;
+  int files;
+  int uring;
+  const psl_filter_t *filter;
+  psl_proc_t *procs;
+  size_t next;
+  pthread_mutex_t lock;
+} psl_scan_pool_t;
+
+/* Per thread scanner state. If `ring` is not NULL, then the small
+   files of a chunk are read with io_uring first, into `prebuf`. */
+
+typedef struct {
+  char buf[PSL_SCAN_BUFFER];
+  ps__uring_t *ring;
+  char *prebuf;
+  psl_prefetch_t pre[PSL_SCAN_CHUNK];
+} psl_scanner_t;
+
+static void psl__scanner_init(psl_scanner_t *sc, int uring) {
+  sc->ring = NULL;
+  sc->prebuf = NULL;
+  if (!uring) return;
+  sc->ring = ps__uring_new(PSL_SCAN_CHUNK * PSL_PRE_MAX);
+  if (sc->ring) {
+    sc->prebuf = malloc(PSL_SCAN_CHUNK * PSL_PRE_MAX * PSL_PRE_BUFFER);
+  }
+  if (!sc->prebuf) {
+    ps__uring_free(sc->ring);
+    sc->ring = NULL;
+  }
+}
+
+static void psl__scanner_free(psl_scanner_t *sc) {
+  ps__uring_free(sc->ring);
+  free(sc->prebuf);
+}
+
+/* Read the small files of `num` processes. If io_uring fails, then we
+   do not use it any more in this scanner, and return -1. */
+
+static int psl__prefetch(psl_scanner_t *sc, pid_t *pids, size_t num,
+			 int files) {
+  char paths[PSL_SCAN_CHUNK * PSL_PRE_MAX][32];
+  const char *ppaths[PSL_SCAN_CHUNK * PSL_PRE_MAX];
+  char *bufs[PSL_SCAN_CHUNK * PSL_PRE_MAX];
+  ssize_t lens[PSL_SCAN_CHUNK * PSL_PRE_MAX];
+  size_t i, n = 0;
+  int k;
+
+  for (i = 0; i < num; i++) {
+    for (k = 0; k < PSL_PRE_MAX; k++) {
+      if (!(files & psl__prefiles[k].flag)) {
+	sc->pre[i].data[k] = NULL;
+	continue;
+      }
+      snprintf(paths[n], sizeof(paths[n]), "/proc/%d/%s", (int) pids[i],
+	       psl__prefiles[k].file);
+      ppaths[n] = paths[n];
+      bufs[n] = sc->pre[i].data[k] = sc->prebuf + n * PSL_PRE_BUFFER;
+      n++;
+    }
+  }
+
+  if (ps__uring_read_files(sc->ring, n, ppaths, bufs, PSL_PRE_BUFFER,
+			   lens)) {
+    ps__uring_free(sc->ring);
+    sc->ring = NULL;
+    return -1;
+  }
+
+  for (i = 0, n = 0; i < num; i++) {
+    for (k = 0; k < PSL_PRE_MAX; k++) {
+      if (sc->pre[i].data[k]) sc->pre[i].len[k] = lens[n++];
+    }
+  }
+
+  return 0;
+}
+
+static void psl__scan_range(psl_scan_pool_t *pool, psl_scanner_t *sc,
+			    size_t from, size_t to) {
+  size_t i;
+  psl_prefetch_t *pre = NULL;
+
+  if (sc->ring && !psl__prefetch(sc, pool->pids + from, to - from,
+				 pool->files)) {
+    pre = sc->pre;
+  }
+
+  for (i = from; i < to; i++) {
+    pool->procs[i].skip = psl__scan_pid(
+      pool->pids[i], pool->files, pool->procs + i, sc->buf,
+      sizeof(sc->buf), pre ? pre + (i - from) : NULL, pool->filter) != 0;
+  }
+}
+
+static void *psl__scan_worker(void *arg) {
+  psl_scan_pool_t *pool = arg;
+  psl_scanner_t sc;
+  size_t from, to;
+
+  psl__scanner_init(&sc, pool->uring);
+
+  while (1) {
+    pthread_mutex_lock(&pool->lock);
+    from = pool->next;
+    to = from + PSL_SCAN_CHUNK < pool->num ? from + PSL_SCAN_CHUNK :
+      pool->num;
+    pool->next = to;
+    pthread_mutex_unlock(&pool->lock);
+    if (from >= to) break;
+    psl__scan_range(pool, &sc, from, to);
+  }
+
+  psl__scanner_free(&sc);
+  return NULL;
+}
+
+/* Fill snap->procs from pids, using `threads` threads (including the
+   calling one). The result is the same as for a serial scan: the
+   processes are in the order of `pids`, the finished ones, and the ones
+   that do not match `filter` (if not NULL) are dropped. */
+
+static void psl__scan(psl_snapshot_t *snap, pid_t *pids, size_t num,
+		      int files, int threads, int uring,
+		      const psl_filter_t *filter) {
+  psl_scan_pool_t pool;
+  pthread_t *workers = NULL;
+  int i, nworkers = 0;
+  size_t j, nchunks;
+
+  pool.pids = pids;
+  pool.num = num;
+  pool.files = files;
+  pool.uring = uring;
+  pool.filter = filter;
+  pool.procs = snap->procs;
+  pool.next = 0;
+
+  /* No point in having threads without work */
+  nchunks = (num + PSL_SCAN_CHUNK - 1) / PSL_SCAN_CHUNK;
+  if (threads < 1) threads = 1;
+  if ((size_t) threads > nchunks) threads = nchunks;
+
+  pthread_mutex_init(&pool.lock, NULL);
+  if (threads > 1) {
+    workers = malloc((threads - 1) * sizeof(pthread_t));
+    /* If we cannot start (some of) the workers, the calling thread does
+       more work. */
+    for (i = 0; workers && i < threads - 1; i++) {
+      if (pthread_create(workers + i, NULL, psl__scan_worker, &pool)) break;
+      nworkers++;
+    }
+  }
+  psl__scan_worker(&pool);
+  for (i = 0; i < nworkers; i++) pthread_join(workers[i], NULL);
+  free(workers);
+  pthread_mutex_destroy(&pool.lock);
+
+  /* Drop the processes that are gone or filtered out */
+  for (j = 0; j < num; j++) {
+    psl_proc_t *proc = snap->procs + j;
+    if (proc->skip) {
+      free(proc->cmdline);
+      free(proc->exe);
+    } else {
+      if (snap->num != j) snap->procs[snap->num] = *proc;
+      snap->num++;
+    }
+  }
+}
+
+SEXP ps__snapshot(SEXP columns, SEXP threads, SEXP uring, SEXP filter) {
+  pid_t *pids;
+  size_t i, num, ncols = LENGTH(columns);
+  int files = 0;
+  int *cols;
+  psl_snapshot_t *snap;
+  psl_filter_t *cfilter;
+  SEXP psnap, pfilter, result, uid = R_NilValue;
+
+  cols = (int*) R_alloc(ncols, sizeof(int));
+  for (i = 0; i < ncols; i++) {
+    const char *cname = CHAR(STRING_ELT(columns, i));
+    int c;
+    for (c = 0; c < PSL_COL_MAX; c++) {
+      if (!strcmp(cname, psl__columns[c].name)) break;
+    }
+    if (c == PSL_COL_MAX) error("Unknown process table column: `%s`", cname);
+    cols[i] = c;
+    files |= psl__columns[c].files;
+  }
+
+  if (psll_linux_init_time()) ps__throw_error();
+
+  psl__smaps_file = getenv("R_PS_SMAPS_ROLLUP");
+  if (!psl__smaps_file) psl__smaps_file = "smaps_rollup";
+
+  PROTECT(pfilter = psl__filter_new(filter));
+  cfilter = isNull(pfilter) ? NULL : R_ExternalPtrAddr(pfilter);
+  if (cfilter) files |= cfilter->files;
+
+  snap = calloc(1, sizeof(psl_snapshot_t));
+  if (!snap) {
+    ps__no_memory("");
+    ps__throw_error();
+  }
+  PROTECT(psnap = R_MakeExternalPtr(snap, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(psnap, psl__snapshot_finalizer, 1);
+
+  if (psl__list_pids(&pids, &num)) {
+    ps__set_error_from_errno();
+    ps__throw_error();
+  }
+  PROTECT_PTR(pids);
+
+  /* E.g. the user does not exist */
+  if (cfilter && cfilter->none) num = 0;
+
+  snap->procs = malloc((num ? num : 1) * sizeof(psl_proc_t));
+  if (!snap->procs) {
+    ps__no_memory("");
+    ps__throw_error();
+  }
+
+  psl__scan(snap, pids, num, files, INTEGER(threads)[0],
+	    LOGICAL(uring)[0], cfilter);
+
+  if (files & PSL_FILE_STATUS) {
+    PROTECT(uid = psl__snapshot_column(PSL_COL_UID, snap, R_NilValue));
+  } else {
+    PROTECT(uid);
+  }
+
+  PROTECT(result = allocVector(VECSXP, ncols));
+  for (i = 0; i < ncols; i++) {
+    SET_VECTOR_ELT(result, i, psl__snapshot_column(cols[i], snap, uid));
+  }
+  setAttrib(result, R_NamesSymbol, columns);
+
+  UNPROTECT(5);
+  return result;
+}
+
+/* ------------------------------------------------------------------- */
+/* Snapshots for diffs                                                  */
+/* ------------------------------------------------------------------- */
+
+/* These snapshots stay on the C side, and they only read the stat
+   file, plus the io file if requested. The processes are ordered by
+   pid, so two snapshots can be merged in linear time. A process is
+   identified by its pid and start time, like for ps_handle_t. */
+
+SEXP psl__snapshot_take(SEXP io, SEXP threads, SEXP uring) {
+  pid_t *pids;
+  size_t num;
+  int files = PSL_FILE_STAT | (LOGICAL(io)[0] ? PSL_FILE_IO : 0);
+  psl_snapshot_t *snap;
+  SEXP psnap, result;
+
+  if (psll_linux_init_time()) ps__throw_error();
+
+  snap = calloc(1, sizeof(psl_snapshot_t));
+  if (!snap) {
+    ps__no_memory("");
+    ps__throw_error();
+  }
+  PROTECT(psnap = R_MakeExternalPtr(snap, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(psnap, psl__snapshot_finalizer, 1);
+
+  if (psl__list_pids(&pids, &num)) {
+    ps__set_error_from_errno();
+    ps__throw_error();
+  }
+  PROTECT_PTR(pids);
+  qsort(pids, num, sizeof(pid_t), psl__cmp_pid);
+
+  snap->procs = malloc((num ? num : 1) * sizeof(psl_proc_t));
+  if (!snap->procs) {
+    ps__no_memory("");
+    ps__throw_error();
+  }
+
+  psl__scan(snap, pids, num, files, INTEGER(threads)[0], LOGICAL(uring)[0],
+	    NULL);
+
+  PROTECT(result = ps__build_list("Oi", psnap, (int) snap->num));
+
+  UNPROTECT(3);
+  return result;
+}
+
+static double psl__created(const psl_proc_t *proc) {
+  return psll_linux_boot_time + proc->starttime * psll_linux_clock_period;
+}
+
+/* pid, ppid, name, created, and optionally ps_handle, for a list of
+   started or exited processes */
+
+static SEXP psl__diff_procs(psl_proc_t **procs, size_t num, int handle) {
+  size_t i;
+  SEXP result, pid, ppid, name, created, ps_handle = R_NilValue;
+
+  PROTECT(pid = allocVector(INTSXP, num));
+  PROTECT(ppid = allocVector(INTSXP, num));
+  PROTECT(name = allocVector(STRSXP, num));
+  PROTECT(created = allocVector(REALSXP, num));
+  if (handle) {
+    PROTECT(ps_handle = allocVector(VECSXP, num));
+  } else {
+    PROTECT(ps_handle);
+  }
+
+  for (i = 0; i < num; i++) {
+    INTEGER(pid)[i] = procs[i]->pid;
+    INTEGER(ppid)[i] = procs[i]->ppid;
+    SET_STRING_ELT(name, i, mkChar(procs[i]->name));
+    REAL(created)[i] = psl__created(procs[i]);
+    if (handle) {
+      SET_VECTOR_ELT(ps_handle, i,
+		     psll__handle(procs[i]->pid, REAL(created)[i]));
+    }
+  }
+
+  if (handle) {
+    result = ps__build_named_list(
+      "OOOOO", "pid", pid, "ppid", ppid, "name", name, "created", created,
+      "ps_handle", ps_handle);
+  } else {
+    result = ps__build_named_list(
+      "OOOO", "pid", pid, "ppid", ppid, "name", name, "created", created);
+  }
+
+  UNPROTECT(5);
+  return result;
+}
+
+/* The io counters are NA if we could not read them */
+
+static double psl__delta(double o, double n) {
+  return ISNA(o) || ISNA(n) ? NA_REAL : n - o;
+}
+
+static int psl__proc_changed(const psl_proc_t *o, const psl_proc_t *n) {
+  int i;
+  if (o->utime != n->utime || o->stime != n->stime ||
+      o->stat_rss != n->stat_rss) return 1;
+  for (i = 0; i < PSL_IO_MAX; i++) {
+    double d = psl__delta(o->io[i], n->io[i]);
+    if (!ISNA(d) && d != 0) return 1;
+  }
+  return 0;
+}
+
+SEXP psl__snapshot_diff(SEXP old_snap, SEXP new_snap) {
+  psl_snapshot_t *os = R_ExternalPtrAddr(old_snap);
+  psl_snapshot_t *ns = R_ExternalPtrAddr(new_snap);
+  psl_proc_t **started, **exited, **changed;
+  size_t i = 0, j = 0, nstarted = 0, nexited = 0, nchanged = 0, k;
+  double page_size = sysconf(_SC_PAGESIZE);
+  SEXP result, pid, name, created, user, system, rss, io[PSL_IO_MAX];
+  SEXP pstarted, pexited, pchanged;
+  int m;
+
+  if (!os || !ns) error("Snapshot pointer cleaned up already");
+
+  started = (psl_proc_t**) R_alloc(ns->num + 1, sizeof(psl_proc_t*));
+  exited = (psl_proc_t**) R_alloc(os->num + 1, sizeof(psl_proc_t*));
+  /* For the changed ones we store the old and the new as well */
+  changed = (psl_proc_t**) R_alloc(2 * ns->num + 1, sizeof(psl_proc_t*));
+
+  while (i < os->num || j < ns->num) {
+    psl_proc_t *o = i < os->num ? os->procs + i : NULL;
+    psl_proc_t *n = j < ns->num ? ns->procs + j : NULL;
+    if (!n || (o && o->pid < n->pid)) {
+      exited[nexited++] = o;
+      i++;
+    } else if (!o || n->pid < o->pid) {
+      started[nstarted++] = n;
+      j++;
+    } else {
+      if (o->starttime != n->starttime) {
+	/* pid was reused */
+	exited[nexited++] = o;
+	started[nstarted++] = n;
+      } else if (psl__proc_changed(o, n)) {
+	changed[2 * nchanged] = o;
+	changed[2 * nchanged + 1] = n;
+	nchanged++;
+      }
+      i++;
+      j++;
+    }
+  }
+
+  PROTECT(pid = allocVector(INTSXP, nchanged));
+  PROTECT(name = allocVector(STRSXP, nchanged));
+  PROTECT(created = allocVector(REALSXP, nchanged));
+  PROTECT(user = allocVector(REALSXP, nchanged));
+  PROTECT(system = allocVector(REALSXP, nchanged));
+  PROTECT(rss = allocVector(REALSXP, nchanged));
+  for (m = 0; m < PSL_IO_MAX; m++) {
+    PROTECT(io[m] = allocVector(REALSXP, nchanged));
+  }
+  for (k = 0; k < nchanged; k++) {
+    psl_proc_t *o = changed[2 * k], *n = changed[2 * k + 1];
+    INTEGER(pid)[k] = n->pid;
+    SET_STRING_ELT(name, k, mkChar(n->name));
+    REAL(created)[k] = psl__created(n);
+    REAL(user)[k] =
+      ((double) n->utime - (double) o->utime) * psll_linux_clock_period;
+    REAL(system)[k] =
+      ((double) n->stime - (double) o->stime) * psll_linux_clock_period;
+    REAL(rss)[k] = ((double) n->stat_rss - (double) o->stat_rss) * page_size;
+    for (m = 0; m < PSL_IO_MAX; m++) {
+      REAL(io[m])[k] = psl__delta(o->io[m], n->io[m]);
+    }
+  }
+
+  PROTECT(pchanged = ps__build_named_list(
+    "OOOOOOOOOOOOO", "pid", pid, "name", name, "created", created,
+    "user", user, "system", system, "rss", rss,
+    "read_bytes", io[PSL_IO_READ_BYTES],
+    "write_bytes", io[PSL_IO_WRITE_BYTES],
+    "rchar", io[PSL_IO_RCHAR], "wchar", io[PSL_IO_WCHAR],
+    "syscr", io[PSL_IO_SYSCR], "syscw", io[PSL_IO_SYSCW],
+    "cancelled_write_bytes", io[PSL_IO_CANCELLED_WRITE_BYTES]));
+  PROTECT(pstarted = psl__diff_procs(started, nstarted, 1));
+  PROTECT(pexited = psl__diff_procs(exited, nexited, 0));
+
+  PROTECT(result = ps__build_named_list(
+    "OOO", "started", pstarted, "exited", pexited, "changed", pchanged));
+
+  UNPROTECT(17);
+  return result;
+}
+
+/* ------------------------------------------------------------------- */
+/* Process tree index                                                   */
+/* ------------------------------------------------------------------- */
+
+/* The parent -> children relation of all processes, from a single scan
+   of /proc, in compressed sparse row form. The children of the process
+   at index `i` are at `children[offsets[i]]` ... `children[offsets[i +
+   1] - 1]`, as indices. The processes are ordered by pid, so a pid is
+   found with a binary search, and the children are ordered by pid as
+   well. */
+
+typedef struct {
+  size_t num;
+  pid_t *pids;
+  pid_t *ppids;
+  double *created;
+  size_t *offsets;
+  size_t *children;
+} psl_tree_t;
+
+static void psl__tree_free(psl_tree_t *tree) {
+  if (!tree) return;
+  free(tree->pids);
+  free(tree->ppids);
+  free(tree->created);
+  free(tree->offsets);
+  free(tree->children);
+  free(tree);
+}
+
+static void psl__tree_finalizer(SEXP x) {
+  psl__tree_free(R_ExternalPtrAddr(x));
+  R_ClearExternalPtr(x);
+}
+
+static long psl__tree_find(const psl_tree_t *tree, pid_t pid) {
+  size_t lo = 0, hi = tree->num;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (tree->pids[mid] < pid) {
+      lo = mid + 1;
+    } else if (tree->pids[mid] > pid) {
+      hi = mid;
+    } else {
+      return mid;
+    }
+  }
+  return -1;
+}
+
+SEXP psl__tree_new() {
+  pid_t *pids;
+  size_t i, num, *next;
+  psl_snapshot_t *snap;
+  psl_tree_t *tree;
+  SEXP psnap, ptree, result;
+
+  if (psll_linux_init_time()) ps__throw_error();
+
+  tree = calloc(1, sizeof(psl_tree_t));
+  snap = calloc(1, sizeof(psl_snapshot_t));
+  if (!tree || !snap) {
+    free(tree);
+    free(snap);
+    ps__no_memory("");
+    ps__throw_error();
+  }
+  PROTECT(ptree = R_MakeExternalPtr(tree, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(ptree, psl__tree_finalizer, 1);
+  PROTECT(psnap = R_MakeExternalPtr(snap, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(psnap, psl__snapshot_finalizer, 1);
+
+  if (psl__list_pids(&pids, &num)) {
+    ps__set_error_from_errno();
+    ps__throw_error();
+  }
+  PROTECT_PTR(pids);
+  qsort(pids, num, sizeof(pid_t), psl__cmp_pid);
+
+  snap->procs = malloc((num ? num : 1) * sizeof(psl_proc_t));
+  if (!snap->procs) {
+    ps__no_memory("");
+    ps__throw_error();
+  }
+  psl__scan(snap, pids, num, PSL_FILE_STAT, 1, 0, NULL);
+
+  num = snap->num;
+  tree->pids = malloc((num ? num : 1) * sizeof(pid_t));
+  tree->ppids = malloc((num ? num : 1) * sizeof(pid_t));
+  tree->created = malloc((num ? num : 1) * sizeof(double));
+  tree->offsets = calloc(num + 1, sizeof(size_t));
+  tree->children = malloc((num ? num : 1) * sizeof(size_t));
+  next = (size_t*) R_alloc(num + 1, sizeof(size_t));
+  if (!tree->pids || !tree->ppids || !tree->created || !tree->offsets ||
+      !tree->children) {
+    ps__no_memory("");
+    ps__throw_error();
+  }
+
+  tree->num = num;
+  for (i = 0; i < num; i++) {
+    tree->pids[i] = snap->procs[i].pid;
+    tree->ppids[i] = snap->procs[i].ppid;
+    tree->created[i] = psl__created(snap->procs + i);
+  }
+
+  /* Count the children first, then fill them in, in pid order */
+  for (i = 0; i < num; i++) {
+    long parent = psl__tree_find(tree, tree->ppids[i]);
+    if (parent >= 0 && parent != i) tree->offsets[parent + 1]++;
+  }
+  for (i = 0; i < num; i++) tree->offsets[i + 1] += tree->offsets[i];
+  memcpy(next, tree->offsets, (num + 1) * sizeof(size_t));
+  for (i = 0; i < num; i++) {
+    long parent = psl__tree_find(tree, tree->ppids[i]);
+    if (parent >= 0 && parent != i) tree->children[next[parent]++] = i;
+  }
+
+  PROTECT(result = ps__build_list("Oi", ptree, (int) num));
+
+  UNPROTECT(4);
+  return result;
+}
+
+/* The index of the process of a handle, or -1 if it was not running
+   when the tree was created. */
+
+static long psl__tree_handle(const psl_tree_t *tree, ps_handle_t *handle) {
+  long i = psl__tree_find(tree, handle->pid);
+  if (i < 0) return -1;
+  if (fabs(tree->created[i] - handle->create_time) >
+      psll_linux_clock_period) {
+    return -1;
+  }
+  return i;
+}
+
+static SEXP psl__tree_handles(const psl_tree_t *tree, const size_t *idx,
+			      size_t num) {
+  size_t i;
+  SEXP result;
+  PROTECT(result = allocVector(VECSXP, num));
+  for (i = 0; i < num; i++) {
+    SET_VECTOR_ELT(result, i, psll__handle(tree->pids[idx[i]],
+					   tree->created[idx[i]]));
+  }
+  UNPROTECT(1);
+  return result;
+}
+
+static psl_tree_t *psl__tree_args(SEXP ptree, SEXP p, long *idx) {
+  psl_tree_t *tree = R_ExternalPtrAddr(ptree);
+  ps_handle_t *handle = R_ExternalPtrAddr(p);
+  if (!tree) error("Process tree pointer cleaned up already");
+  if (!handle) error("Process pointer cleaned up already");
+  *idx = psl__tree_handle(tree, handle);
+  if (*idx < 0) {
+    ps__no_such_process(handle->pid, 0);
+    ps__throw_error();
+  }
+  return tree;
+}
+
+/* Breadth first, so the children come before the grandchildren. A
+   child must not be older than its parent, otherwise its parent pid
+   was reused. */
+
+SEXP psl__tree_descendants(SEXP ptree, SEXP p, SEXP recursive) {
+  long root;
+  psl_tree_t *tree = psl__tree_args(ptree, p, &root);
+  int rec = LOGICAL(recursive)[0];
+  size_t *out, nout = 0, head = 0, i, j;
+
+  out = (size_t*) R_alloc(tree->num ? tree->num : 1, sizeof(size_t));
+  i = root;
+  while (1) {
+    for (j = tree->offsets[i]; j < tree->offsets[i + 1]; j++) {
+      size_t child = tree->children[j];
+      if (tree->created[child] >= tree->created[i] && nout < tree->num) {
+	out[nout++] = child;
+      }
+    }
+    if (!rec || head == nout) break;
+    i = out[head++];
+  }
+
+  return psl__tree_handles(tree, out, nout);
+}
+
+/* The parent first, then its parent, etc. */
+
+SEXP psl__tree_ancestors(SEXP ptree, SEXP p) {
+  long i;
+  psl_tree_t *tree = psl__tree_args(ptree, p, &i);
+  size_t *out, nout = 0;
+
+  out = (size_t*) R_alloc(tree->num ? tree->num : 1, sizeof(size_t));
+  while (nout < tree->num) {
+    long parent = psl__tree_find(tree, tree->ppids[i]);
+    if (parent < 0 || parent == i ||
+	tree->created[parent] > tree->created[i]) {
+      break;
+    }
+    out[nout++] = parent;
+    i = parent;
+  }
+
+  return psl__tree_handles(tree, out, nout);
+}
+
+/* ------------------------------------------------------------------- */
+/* Children from /proc/<pid>/task/<tid>/children                       */
+/* ------------------------------------------------------------------- */
+
+/* These files need a kernel with CONFIG_PROC_CHILDREN. They list the
+   children of a thread, so the children of a process are the union
+   over its threads. With them we do not need to scan all of /proc to
+   find the children of a process. */
+
+static int psl__has_children_files(void) {
+  static int has = -1;
+  if (has == -1) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/children",
+	     (int) getpid(), (int) getpid());
+    has = access(path, R_OK) == 0;
+  }
+  return has;
+}
+
+/* Append the whitespace separated pids in `buf` to `*pids`, which is
+   allocated with R_alloc(), and grown as needed. */
+
+static void psl__parse_pids(const char *buf, size_t len, pid_t **pids,
+			    size_t *num, size_t *size) {
+  const char *ptr, *end;
+  for (ptr = buf, end = buf + len; ptr < end; ) {
+    long pid = 0;
+    while (ptr < end && (*ptr < '0' || *ptr > '9')) ptr++;
+    if (ptr == end) break;
+    while (ptr < end && *ptr >= '0' && *ptr <= '9') {
+      pid = pid * 10 + (*ptr++ - '0');
+    }
+    if (*num == *size) {
+      pid_t *new = (pid_t*) R_alloc(*size * 2, sizeof(pid_t));
+      memcpy(new, *pids, *num * sizeof(pid_t));
+      *pids = new;
+      *size *= 2;
+    }
+    (*pids)[(*num)++] = pid;
+  }
+}
+
+/* Append the children of `pid` to `*children`, see psl__parse_pids().
+   Threads that are gone are skipped. */
+
+static void psl__task_children(pid_t pid, pid_t **children, size_t *num,
+			       size_t *size) {
+  char path[PATH_MAX];
+  DIR *dir;
+  struct dirent *entry;
+
+  snprintf(path, sizeof(path), "/proc/%d/task", (int) pid);
+  dir = opendir(path);
+  if (!dir) return;
+
+  while ((entry = readdir(dir)) != NULL) {
+    char *buf = NULL;
+    ssize_t len;
+    if (entry->d_name[0] < '0' || entry->d_name[0] > '9') continue;
+    snprintf(path, sizeof(path), "/proc/%d/task/%s/children", (int) pid,
+	     entry->d_name);
+    len = psl__read_file_alloc(path, &buf);
+    if (len <= 0) {
+      free(buf);
+      continue;
+    }
+    psl__parse_pids(buf, len, children, num, size);
+    free(buf);
+  }
+
+  closedir(dir);
+}
+
+/* Returns NULL if the children files are not available. Breadth first,
+   like psl__tree_descendants(), and a child must not be older than its
+   parent, otherwise the parent's pid was reused. */
+
+typedef struct {
+  pid_t pid;
+  double created;
+} psl_child_t;
+
+SEXP psl__children(SEXP p, SEXP recursive) {
+  ps_handle_t *handle = R_ExternalPtrAddr(p);
+  int rec = LOGICAL(recursive)[0];
+  size_t tsize = 64, tnum, size = 64, num = 0, head = 0, i;
+  pid_t *tmp, parent;
+  psl_child_t *out;
+  double pcreated;
+  SEXP result;
+
+  if (!handle) error("Process pointer cleaned up already");
+  if (!psl__has_children_files()) return R_NilValue;
+  PS__CHECK_HANDLE(handle);
+
+  tmp = (pid_t*) R_alloc(tsize, sizeof(pid_t));
+  out = (psl_child_t*) R_alloc(size, sizeof(psl_child_t));
+  parent = handle->pid;
+  pcreated = handle->create_time;
+
+  while (1) {
+    tnum = 0;
+    psl__task_children(parent, &tmp, &tnum, &tsize);
+    for (i = 0; i < tnum; i++) {
+      psl_stat_t stat;
+      double created;
+      if (psll__parse_stat_file(tmp[i], &stat, 0)) continue;
+      created = psll_linux_boot_time +
+	stat.starttime * psll_linux_clock_period;
+      if (created < pcreated) continue;
+      if (num == size) {
+	psl_child_t *new = (psl_child_t*) R_alloc(size * 2,
+						  sizeof(psl_child_t));
+	memcpy(new, out, num * sizeof(psl_child_t));
+	out = new;
+	size *= 2;
+      }
+      out[num].pid = tmp[i];
+      out[num].created = created;
+      num++;
+    }
+    if (!rec || head == num) break;
+    parent = out[head].pid;
+    pcreated = out[head].created;
+    head++;
+  }
+
+  PROTECT(result = allocVector(VECSXP, num));
+  for (i = 0; i < num; i++) {
+    SET_VECTOR_ELT(result, i, psll__handle(out[i].pid, out[i].created));
+  }
+
+  UNPROTECT(1);
+  return result;
+}
+
+/* ------------------------------------------------------------------- */
+/* Queries on many handles                                              */
+/* ------------------------------------------------------------------- */
+
+/* These work on a list of handles, and they do not throw errors for
+   processes that are gone, or cannot be queried, but return NA. If
+   there were such processes, then the error codes are in the `error`
+   attribute of the result, see ps__error_code_string(). */
+
+typedef enum {
+  PSL_Q_PID = 0,
+  PSL_Q_CREATE_TIME,
+  PSL_Q_IS_RUNNING,
+  PSL_Q_PPID,
+  PSL_Q_NAME,
+  PSL_Q_STATUS,
+  PSL_Q_NUM_THREADS,
+  PSL_Q_CPU_TIMES,
+  PSL_Q_MEMORY_INFO,
+  PSL_Q_MAX
+} psl_query_t;
+
+static const char *psl__queries[PSL_Q_MAX] = {
+  "pid", "create_time", "is_running", "ppid", "name", "status",
+  "num_threads", "cpu_times", "memory_info"
+};
+
+/* Read a /proc file of a handle into `buf`, like ps__read_file_buf(),
+   via the held file if the handle has one. */
+
+static ssize_t psl__handle_read_buf(ps_handle_t *handle, int which,
+				    char *buf, size_t bufsize) {
+  char path[64];
+
+  if (handle->procfd) {
+    char *data;
+    ssize_t ret = psll__held_read(handle, which, &data);
+    if (ret <= 0) return ret;
+    if (ret > bufsize - 1) ret = bufsize - 1;
+    memcpy(buf, data, ret);
+    buf[ret] = '\0';
+    return ret;
+  }
+
+  snprintf(path, sizeof(path), "/proc/%d/%s", (int) handle->pid,
+	   psll__held_files[which].name);
+  return ps__read_file_buf(path, buf, bufsize);
+}
+
+/* Read and parse the stat file of a handle. Returns -1 and sets errno
+   if the process is gone, or the stat file cannot be read. */
+
+static int psl__handle_scan_stat(ps_handle_t *handle, psl_stat_t *stat,
+				 char **name, char *buf, size_t bufsize) {
+  double ctime;
+
+  if (psl__handle_read_buf(handle, PSL_HELD_STAT, buf, bufsize) <= 0) {
+    return -1;
+  }
+  if (psll__parse_stat(buf, stat, name)) {
+    errno = EINVAL;
+    return -1;
+  }
+  ctime = psll_linux_boot_time + stat->starttime * psll_linux_clock_period;
+  if (fabs(ctime - handle->create_time) > psll_linux_clock_period) {
+    errno = ESRCH;
+    return -1;
+  }
+  return 0;
+}
+
+static SEXP psl__handles_matrix(SEXPTYPE type, size_t num, SEXP colnames) {
+  SEXP result, dimnames;
+  PROTECT(result = allocMatrix(type, num, LENGTH(colnames)));
+  PROTECT(dimnames = allocVector(VECSXP, 2));
+  SET_VECTOR_ELT(dimnames, 1, colnames);
+  setAttrib(result, R_DimNamesSymbol, dimnames);
+  UNPROTECT(2);
+  return result;
+}
+
+SEXP psl__handles(SEXP handles, SEXP what) {
+  size_t i, j, num = LENGTH(handles);
+  const char *cwhat = CHAR(STRING_ELT(what, 0));
+  char buf[PSL_SCAN_BUFFER];
+  int q, nprotect = 1, *codes;
+  SEXP result, colnames;
+
+  for (q = 0; q < PSL_Q_MAX; q++) {
+    if (!strcmp(cwhat, psl__queries[q])) break;
+  }
+  if (q == PSL_Q_MAX) error("Unknown process query: `%s`", cwhat);
+
+  if (psll_linux_init_time()) ps__throw_error();
+
+  codes = (int*) R_alloc(num ? num : 1, sizeof(int));
+  memset(codes, 0, (num ? num : 1) * sizeof(int));
+
+  switch (q) {
+  case PSL_Q_PID:
+  case PSL_Q_PPID:
+  case PSL_Q_NUM_THREADS:
+    PROTECT(result = allocVector(INTSXP, num));
+    break;
+  case PSL_Q_CREATE_TIME:
+    PROTECT(result = allocVector(REALSXP, num));
+    break;
+  case PSL_Q_IS_RUNNING:
+    PROTECT(result = allocVector(LGLSXP, num));
+    break;
+  case PSL_Q_NAME:
+  case PSL_Q_STATUS:
+    PROTECT(result = allocVector(STRSXP, num));
+    break;
+  case PSL_Q_CPU_TIMES:
+    PROTECT(colnames = ps__build_string(
+      "user", "system", "childen_user", "children_system", NULL));
+    PROTECT(result = psl__handles_matrix(REALSXP, num, colnames));
+    nprotect = 2;
+    break;
+  case PSL_Q_MEMORY_INFO:
+    PROTECT(colnames = ps__build_string(
+      "rss", "vms", "shared", "text", "lib", "data", "dirty", NULL));
+    PROTECT(result = psl__handles_matrix(INTSXP, num, colnames));
+    nprotect = 2;
+    break;
+  default:
+    error("Unknown process query");
+  }
+
+  for (i = 0; i < num; i++) {
+    ps_handle_t *handle = R_ExternalPtrAddr(VECTOR_ELT(handles, i));
+    psl_stat_t stat;
+    char *name;
+    int ok;
+
+    if (!handle) error("Process pointer cleaned up already");
+
+    if (q == PSL_Q_PID) {
+      INTEGER(result)[i] = handle->pid;
+      continue;
+    } else if (q == PSL_Q_CREATE_TIME) {
+      REAL(result)[i] = handle->create_time;
+      continue;
+    }
+
+    ok = !psl__handle_scan_stat(handle, &stat, &name, buf, sizeof(buf));
+    /* A process that is gone is not an error for ps_is_running() */
+    if (!ok && (q != PSL_Q_IS_RUNNING || !psl__gone())) {
+      codes[i] = ps__error_code_from_errno(errno);
+    }
+    /* Like for a single handle, these are errors for zombies */
+    if (ok && stat.state == 'Z' &&
+	(q == PSL_Q_NUM_THREADS || q == PSL_Q_CPU_TIMES ||
+	 q == PSL_Q_MEMORY_INFO)) {
+      ok = 0;
+      codes[i] = PS__ZOMBIE_PROCESS;
+    }
+
+    switch (q) {
+    case PSL_Q_IS_RUNNING:
+      LOGICAL(result)[i] = ok;
+      break;
+    case PSL_Q_PPID:
+      INTEGER(result)[i] = ok ? stat.ppid : NA_INTEGER;
+      break;
+    case PSL_Q_NUM_THREADS:
+      INTEGER(result)[i] = ok ? stat.num_threads : NA_INTEGER;
+      break;
+    case PSL_Q_NAME:
+      if (ok) {
+	psl_proc_t proc;
+	memset(&proc, 0, sizeof(proc));
+	proc.pid = handle->pid;
+	strncpy(proc.name, name, PSL_NAME_LEN - 1);
+	if (strlen(proc.name) >= 15) {
+	  psl__scan_long_name(&proc, buf, sizeof(buf));
+	}
+	SET_STRING_ELT(result, i, mkChar(proc.name));
+      } else {
+	SET_STRING_ELT(result, i, NA_STRING);
+      }
+      break;
+    case PSL_Q_STATUS: {
+      const char *st = ok ? psl__status_name(stat.state) : NULL;
+      SET_STRING_ELT(result, i, st ? mkChar(st) : NA_STRING);
+      break;
+    }
+    case PSL_Q_CPU_TIMES:
+      REAL(result)[i] = ok ? stat.utime * psll_linux_clock_period : NA_REAL;
+      REAL(result)[i + num] =
+	ok ? stat.stime * psll_linux_clock_period : NA_REAL;
+      REAL(result)[i + 2 * num] =
+	ok ? stat.cutime * psll_linux_clock_period : NA_REAL;
+      REAL(result)[i + 3 * num] =
+	ok ? stat.cstime * psll_linux_clock_period : NA_REAL;
+      break;
+    case PSL_Q_MEMORY_INFO: {
+      unsigned long v[7];
+      if (ok) {
+	ssize_t len = psl__handle_read_buf(handle, PSL_HELD_STATM, buf,
+					   sizeof(buf));
+	ok = len > 0 &&
+	  sscanf(buf, "%lu %lu %lu %lu %lu %lu %lu", v, v + 1, v + 2, v + 3,
+		 v + 4, v + 5, v + 6) == 7;
+	if (!ok) {
+	  codes[i] = len == -1 ? ps__error_code_from_errno(errno) :
+	    PS__OS_ERROR;
+	}
+      }
+      for (j = 0; j < 7; j++) {
+	INTEGER(result)[i + j * num] = ok ? v[j] : NA_INTEGER;
+      }
+      break;
+    }
+    default:
+      break;
+    }
+  }
+
+  for (i = 0; i < num; i++) if (codes[i]) break;
+  if (i < num) {
+    SEXP errors = PROTECT(allocVector(STRSXP, num));
+    for (i = 0; i < num; i++) {
+      SET_STRING_ELT(errors, i, ps__error_code_string(codes[i]));
+    }
+    setAttrib(result, install("error"), errors);
+    UNPROTECT(1);
+  }
+
+  UNPROTECT(nprotect);
+  return result;
+}
+
+/* ------------------------------------------------------------------- */
+/* Threads                                                              */
+/* ------------------------------------------------------------------- */
+
+/* The threads of a list of processes, from /proc/<pid>/task/<tid>/stat,
+   in columns. Processes that are gone are skipped, unless `strict` is
+   TRUE, then they are errors, and so are zombies. Threads that finish
+   while we are listing them are skipped. */
+
+typedef struct {
+  pid_t pid;
+  pid_t tid;
+  char name[PSL_NAME_LEN];
+  char state;
+  double user;
+  double system;
+  int processor;
+} psl_thread_t;
+
+SEXP psl__threads(SEXP handles, SEXP strict) {
+  size_t i, j, num = LENGTH(handles), size = 64, n = 0;
+  int cstrict = LOGICAL(strict)[0];
+  char buf[PSL_SCAN_BUFFER], path[PATH_MAX];
+  psl_thread_t *thr;
+  SEXP pid, tid, name, status, user, system, processor, result;
+
+  if (psll_linux_init_time()) ps__throw_error();
+
+  thr = (psl_thread_t*) R_alloc(size, sizeof(psl_thread_t));
+
+  for (i = 0; i < num; i++) {
+    ps_handle_t *handle = R_ExternalPtrAddr(VECTOR_ELT(handles, i));
+    size_t first = n;
+    psl_stat_t stat;
+    char *cname;
+    DIR *dir;
+    struct dirent *entry;
+    int ok;
+
+    if (!handle) error("Process pointer cleaned up already");
+
+    ok = !psl__handle_scan_stat(handle, &stat, &cname, buf, sizeof(buf));
+    if (cstrict && (!ok || stat.state == 'Z')) {
+      ps__check_for_zombie(handle, 1);
+    }
+    if (!ok) continue;
+
+    snprintf(path, sizeof(path), "/proc/%d/task", (int) handle->pid);
+    dir = opendir(path);
+    if (!dir) {
+      if (cstrict) ps__check_for_zombie(handle, 1);
+      continue;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+      psl_thread_t *t;
+      if (entry->d_name[0] < '0' || entry->d_name[0] > '9') continue;
+      snprintf(path, sizeof(path), "/proc/%d/task/%s/stat",
+	       (int) handle->pid, entry->d_name);
+      if (ps__read_file_buf(path, buf, sizeof(buf)) <= 0) continue;
+      if (psll__parse_stat(buf, &stat, &cname)) continue;
+      if (n == size) {
+	psl_thread_t *new = (psl_thread_t*) R_alloc(size * 2,
+						    sizeof(psl_thread_t));
+	memcpy(new, thr, n * sizeof(psl_thread_t));
+	thr = new;
+	size *= 2;
+      }
+      t = thr + n++;
+      t->pid = handle->pid;
+      t->tid = strtol(entry->d_name, NULL, 10);
+      strncpy(t->name, cname, PSL_NAME_LEN - 1);
+      t->name[PSL_NAME_LEN - 1] = '\0';
+      t->state = stat.state;
+      t->user = stat.utime * psll_linux_clock_period;
+      t->system = stat.stime * psll_linux_clock_period;
+      t->processor = stat.processor;
+
+      /* If the pid was reused since we checked it, then drop the
+	 threads of the new process. */
+      if (t->tid == handle->pid &&
+	  fabs(psll_linux_boot_time + stat.starttime *
+	       psll_linux_clock_period - handle->create_time) >
+	  psll_linux_clock_period) {
+	n = first;
+	break;
+      }
+    }
+
+    closedir(dir);
+  }
+
+  PROTECT(pid = allocVector(INTSXP, n));
+  PROTECT(tid = allocVector(INTSXP, n));
+  PROTECT(name = allocVector(STRSXP, n));
+  PROTECT(status = allocVector(STRSXP, n));
+  PROTECT(user = allocVector(REALSXP, n));
+  PROTECT(system = allocVector(REALSXP, n));
+  PROTECT(processor = allocVector(INTSXP, n));
+
+  for (j = 0; j < n; j++) {
+    const char *st = psl__status_name(thr[j].state);
+    INTEGER(pid)[j] = thr[j].pid;
+    INTEGER(tid)[j] = thr[j].tid;
+    SET_STRING_ELT(name, j, mkChar(thr[j].name));
+    SET_STRING_ELT(status, j, st ? mkChar(st) : NA_STRING);
+    REAL(user)[j] = thr[j].user;
+    REAL(system)[j] = thr[j].system;
+    INTEGER(processor)[j] = thr[j].processor;
+  }
+
+  PROTECT(result = ps__build_named_list(
+    "OOOOOOO", "pid", pid, "tid", tid, "name", name, "status", status,
+    "user", user, "system", system, "processor", processor));
+
+  UNPROTECT(8);
+  return result;
+}
+
+/* ------------------------------------------------------------------- */
+/* Waiting for processes                                                */
+/* ------------------------------------------------------------------- */
+
+/* The processes with a pidfd are poll()-ed, the pidfd becomes readable
+   when the process exits. The others are checked via their stat file,
+   with an increasing delay. We wake up at least every PSL_WAIT_SLICE
+   milliseconds, to check for interrupts. A zombie process counts as
+   finished here. */
+
+#define PSL_WAIT_SLICE 200
+#define PSL_WAIT_MAX_DELAY 50
+
+static double psl__now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int psl__wait_done(ps_handle_t *handle) {
+  char path[64], buf[2048];
+  psl_stat_t stat;
+  double ctime;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int) handle->pid);
+  if (ps__read_file_buf(path, buf, sizeof(buf)) <= 0) return psl__gone();
+  if (psll__parse_stat(buf, &stat, 0)) return 1;
+  ctime = psll_linux_boot_time + stat.starttime * psll_linux_clock_period;
+  if (fabs(ctime - handle->create_time) > psll_linux_clock_period) {
+    return 1;
+  }
+  return stat.state == 'Z' || stat.state == 'X' || stat.state == 'x';
+}
+
+SEXP psl__wait(SEXP handles, SEXP timeout, SEXP all) {
+  R_xlen_t i, j, num = XLENGTH(handles);
+  int ctimeout = INTEGER(timeout)[0], call = LOGICAL(all)[0];
+  struct pollfd *fds;
+  R_xlen_t *fdidx, nfds = 0, ndone = 0;
+  int *done, delay = 1, npolled = 0;
+  double deadline = 0;
+  SEXP result;
+
+  if (psll_linux_init_time()) ps__throw_error();
+
+  PROTECT(result = allocVector(LGLSXP, num));
+  done = LOGICAL(result);
+  fds = (struct pollfd*) R_alloc(num ? num : 1, sizeof(struct pollfd));
+  fdidx = (R_xlen_t*) R_alloc(num ? num : 1, sizeof(R_xlen_t));
+
+  for (i = 0; i < num; i++) {
+    ps_handle_t *handle = R_ExternalPtrAddr(VECTOR_ELT(handles, i));
+    int pidfd;
+    if (!handle) error("Process pointer cleaned up already");
+    done[i] = 0;
+    pidfd = psll__pidfd(handle);
+    if (pidfd >= 0) {
+      fds[nfds].fd = pidfd;
+      fds[nfds].events = POLLIN;
+      fds[nfds].revents = 0;
+      fdidx[nfds++] = i;
+    } else {
+      npolled++;
+    }
+  }
+
+  if (ctimeout >= 0) deadline = psl__now() + ctimeout / 1000.0;
+
+  while (1) {
+    int ms = PSL_WAIT_SLICE, ret;
+
+    if (npolled) {
+      for (i = 0; i < num; i++) {
+	ps_handle_t *handle = R_ExternalPtrAddr(VECTOR_ELT(handles, i));
+	if (done[i] || handle->pidfd >= 0) continue;
+	if (psl__wait_done(handle)) {
+	  done[i] = 1;
+	  ndone++;
+	}
+      }
+      if (delay < ms) ms = delay;
+      delay = delay * 2 < PSL_WAIT_MAX_DELAY ? delay * 2 : PSL_WAIT_MAX_DELAY;
+    }
+
+    if (call ? ndone == num : ndone > 0) break;
+
+    if (ctimeout >= 0) {
+      double left = deadline - psl__now();
+      if (left <= 0) break;
+      if (left * 1000 < ms) ms = (int) (left * 1000) + 1;
+    }
+
+    ret = poll(fds, nfds, ms);
+    if (ret == -1 && errno != EINTR) {
+      ps__set_error_from_errno();
+      ps__throw_error();
+    }
+    for (j = 0; ret > 0 && j < nfds; j++) {
+      if (fds[j].fd >= 0 && fds[j].revents) {
+	done[fdidx[j]] = 1;
+	ndone++;
+	/* poll() ignores negative fds */
+	fds[j].fd = -1;
+      }
+    }
+
+    R_CheckUserInterrupt();
+  }
+
+  UNPROTECT(1);
+  return result;
+}
+
+/* ------------------------------------------------------------------- */
+/* Marked process trees                                                 */
+/* ------------------------------------------------------------------- */
+
+/* Find (and optionally signal) the processes that have `marker` in
+   their environment, in a single pass. The marker was created at
+   `after`, so older processes cannot have it, and we only need to read
+   the stat file for those. The stat file is much smaller than the
+   environment, so this is much faster on hosts with many processes.
+   The start time of a process is only precise up to the boot time, so
+   we allow a second. */
+
+SEXP psl__find_tree(SEXP marker, SEXP after, SEXP sig) {
+  const char *cmarker = CHAR(STRING_ELT(marker, 0));
+  size_t marker_len = strlen(cmarker);
+  double cafter = REAL(after)[0];
+  int kill_them = !isNull(sig), csig = kill_them ? INTEGER(sig)[0] : 0;
+  pid_t *pids, mypid = getpid();
+  size_t i, num, nfound = 0;
+  char path[64], buf[2048];
+  size_t *found;
+  double *created;
+  char (*names)[PSL_NAME_LEN];
+  SEXP result, rnames;
+
+  if (psll_linux_init_time()) ps__throw_error();
+
+  if (psl__list_pids(&pids, &num)) {
+    ps__set_error_from_errno();
+    ps__throw_error();
+  }
+  PROTECT_PTR(pids);
+  found = (size_t*) R_alloc(num ? num : 1, sizeof(size_t));
+  created = (double*) R_alloc(num ? num : 1, sizeof(double));
+  names = (char(*)[PSL_NAME_LEN]) R_alloc(num ? num : 1, PSL_NAME_LEN);
+
+  for (i = 0; i < num; i++) {
+    psl_stat_t stat;
+    char *name;
+    ssize_t len;
+
+    if (pids[i] == mypid) continue;
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pids[i]);
+    if (ps__read_file_buf(path, buf, sizeof(buf)) <= 0) continue;
+    if (psll__parse_stat(buf, &stat, &name)) continue;
+    created[i] = psll_linux_boot_time +
+      stat.starttime * psll_linux_clock_period;
+    if (!ISNAN(cafter) && created[i] < cafter - 1) continue;
+
+    snprintf(path, sizeof(path), "/proc/%d/environ", (int) pids[i]);
+    len = psl__read_file_reuse(path, &psl__environ_buf, &psl__environ_size);
+    if (len <= 0) continue;
+    if (!psl__environ_has(psl__environ_buf, len, cmarker, marker_len)) {
+      continue;
+    }
+
+    if (kill_them && kill(pids[i], csig) == -1) continue;
+    strncpy(names[nfound], name, PSL_NAME_LEN - 1);
+    names[nfound][PSL_NAME_LEN - 1] = '\0';
+    found[nfound++] = i;
+  }
+
+  if (kill_them) {
+    /* Named integer vector of pids, the names are the process names */
+    PROTECT(result = allocVector(INTSXP, nfound));
+    PROTECT(rnames = allocVector(STRSXP, nfound));
+    for (i = 0; i < nfound; i++) {
+      INTEGER(result)[i] = pids[found[i]];
+      SET_STRING_ELT(rnames, i, mkChar(names[i]));
+    }
+    setAttrib(result, R_NamesSymbol, rnames);
+
+  } else {
+    PROTECT(result = allocVector(VECSXP, nfound));
+    PROTECT(rnames = R_NilValue);
+    for (i = 0; i < nfound; i++) {
+      SET_VECTOR_ELT(result, i, psll__handle(pids[found[i]],
+					     created[found[i]]));
+    }
+  }
+
+  UNPROTECT(3);
+  return result;
+}
+
+/* ------------------------------------------------------------------- */
+/* cgroup v2 process trees                                              */
+/* ------------------------------------------------------------------- */
+
+/* ps_mark_tree(cgroup = TRUE) moves the R process into a new cgroup,
+   below its current one. Child processes inherit the cgroup, even if
+   they clear their environment, so we can list them from cgroup.procs,
+   and kill them with a single write to cgroup.kill. This needs cgroup
+   v2, and write access to our own cgroup, i.e. a delegated subtree. If
+   entering the cgroup fails, the R code falls back to the environment
+   variable marker. Before we kill the cgroup, we move the R process
+   back to the parent cgroup. */
+
+static int psl__write_file(const char *path, const char *str) {
+  ssize_t len = strlen(str), ret;
+  int fd = open(path, O_WRONLY | O_CLOEXEC), err;
+  if (fd == -1) return -1;
+  ret = write(fd, str, len);
+  if (ret != len) {
+    err = ret == -1 ? errno : EIO;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return close(fd);
+}
+
+/* The directory of our cgroup, in the cgroup v2 hierarchy. */
+
+static int psl__cgroup_self(char *path, size_t size) {
+  char *buf, *line, *next, *end, *mnt = NULL, *root = NULL, *cg = NULL;
+  size_t rootlen;
+  ssize_t len;
+  int ret = -1;
+
+  len = psl__read_file_alloc("/proc/self/mountinfo", &buf);
+  if (len <= 0) return -1;
+  for (line = buf, end = buf + len; line < end; line = next) {
+    char *sep, *fields[5];
+    int i;
+    next = memchr(line, '\n', end - line);
+    if (next) *next++ = '\0'; else next = end;
+    sep = strstr(line, " - ");
+    if (!sep || strncmp(sep + 3, "cgroup2 ", 8)) continue;
+    *sep = '\0';
+    for (i = 0; i < 5 && line; i++) {
+      fields[i] = strsep(&line, " ");
+    }
+    if (i < 5 || !fields[4]) continue;
+    root = fields[3];
+    mnt = fields[4];
+    break;
+  }
+  if (!mnt) {
+    errno = ENOENT;
+    goto cleanup;
+  }
+  mnt = strdup(mnt);
+  root = strdup(root);
+  free(buf);
+  buf = NULL;
+  if (!mnt || !root) goto cleanup;
+
+  len = psl__read_file_alloc("/proc/self/cgroup", &buf);
+  if (len <= 0) goto cleanup;
+  for (line = buf, end = buf + len; line < end; line = next) {
+    next = memchr(line, '\n', end - line);
+    if (next) *next++ = '\0'; else next = end;
+    if (!strncmp(line, "0::", 3)) {
+      cg = line + 3;
+      break;
+    }
+  }
+  if (!cg) {
+    errno = ENOENT;
+    goto cleanup;
+  }
+
+  /* If the hierarchy is not mounted at its root, then we can only use
+     it if our cgroup is inside the mounted subtree. */
+  rootlen = strlen(root);
+  if (!strcmp(root, "/")) rootlen = 0;
+  if (strncmp(cg, root, rootlen) || (cg[rootlen] && cg[rootlen] != '/')) {
+    errno = ENOENT;
+    goto cleanup;
+  }
+  cg += rootlen;
+  if (!strcmp(cg, "/")) cg = "";
+
+  if (snprintf(path, size, "%s%s", mnt, cg) >= size) {
+    errno = ENAMETOOLONG;
+    goto cleanup;
+  }
+  ret = 0;
+
+ cleanup:
+  free(buf);
+  free(mnt);
+  free(root);
+  return ret;
+}
+
+static int psl__cgroup_move(const char *dir, pid_t pid) {
+  char path[PATH_MAX], str[32];
+  if (snprintf(path, sizeof(path), "%s/cgroup.procs", dir) >=
+      sizeof(path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  snprintf(str, sizeof(str), "%d", (int) pid);
+  return psl__write_file(path, str);
+}
+
+/* Move the R process back to `parent`, if it is in `dir`, or below. */
+
+static int psl__cgroup_move_out(const char *dir, const char *parent) {
+  char self[PATH_MAX];
+  size_t len = strlen(dir);
+  if (psl__cgroup_self(self, sizeof(self))) return -1;
+  if (strncmp(self, dir, len) || (self[len] && self[len] != '/')) return 0;
+  return psl__cgroup_move(parent, getpid());
+}
+
+/* All pids in `dir` and its child cgroups, see psl__parse_pids() */
+
+static void psl__cgroup_pids(const char *dir, pid_t **pids, size_t *num,
+			     size_t *size) {
+  char path[PATH_MAX], *buf;
+  ssize_t len;
+  DIR *d;
+  struct dirent *entry;
+
+  snprintf(path, sizeof(path), "%s/cgroup.procs", dir);
+  len = psl__read_file_alloc(path, &buf);
+  if (len > 0) psl__parse_pids(buf, len, pids, num, size);
+  free(buf);
+
+  d = opendir(dir);
+  if (!d) return;
+  while ((entry = readdir(d)) != NULL) {
+    if (entry->d_type != DT_DIR || entry->d_name[0] == '.') continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+    psl__cgroup_pids(path, pids, num, size);
+  }
+  closedir(d);
+}
+
+/* Wait until cgroup.events has `line`, at most `timeout` milliseconds */
+
+static int psl__cgroup_wait(const char *dir, const char *line,
+			    int timeout) {
+  char path[PATH_MAX], buf[256];
+  double deadline = psl__now() + timeout / 1000.0;
+  int delay = 1;
+
+  snprintf(path, sizeof(path), "%s/cgroup.events", dir);
+  for (;;) {
+    struct timespec ts;
+    if (ps__read_file_buf(path, buf, sizeof(buf)) <= 0) return -1;
+    if (strstr(buf, line)) return 0;
+    if (psl__now() >= deadline) return -1;
+    ts.tv_sec = 0;
+    ts.tv_nsec = delay * 1000000L;
+    nanosleep(&ts, NULL);
+    if (delay < PSL_WAIT_MAX_DELAY) delay *= 2;
+  }
+}
+
+static int psl__cgroup_rmdir(const char *dir) {
+  char path[PATH_MAX];
+  DIR *d;
+  struct dirent *entry;
+
+  d = opendir(dir);
+  if (!d) return errno == ENOENT ? 0 : -1;
+  while ((entry = readdir(d)) != NULL) {
+    if (entry->d_type != DT_DIR || entry->d_name[0] == '.') continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+    psl__cgroup_rmdir(path);
+  }
+  closedir(d);
+  return rmdir(dir);
+}
+
+/* Returns c(cgroup, parent), or NULL if we cannot create a cgroup, or
+   cannot move into it. */
+
+SEXP psl__cgroup_enter(SEXP name) {
+  char parent[PATH_MAX], dir[PATH_MAX];
+  SEXP result;
+
+  if (psl__cgroup_self(parent, sizeof(parent))) return R_NilValue;
+  if (snprintf(dir, sizeof(dir), "%s/%s", parent,
+	       CHAR(STRING_ELT(name, 0))) >= sizeof(dir)) {
+    return R_NilValue;
+  }
+  if (mkdir(dir, 0755) == -1) return R_NilValue;
+  if (psl__cgroup_move(dir, getpid())) {
+    rmdir(dir);
+    return R_NilValue;
+  }
+
+  PROTECT(result = allocVector(STRSXP, 2));
+  SET_STRING_ELT(result, 0, mkChar(dir));
+  SET_STRING_ELT(result, 1, mkChar(parent));
+  UNPROTECT(1);
+  return result;
+}
+
+SEXP psl__cgroup_leave(SEXP cgroup) {
+  if (psl__cgroup_move_out(CHAR(STRING_ELT(cgroup, 0)),
+			   CHAR(STRING_ELT(cgroup, 1)))) {
+    ps__set_error_from_errno();
+    ps__throw_error();
+  }
+  return R_NilValue;
+}
+
+SEXP psl__cgroup_find(SEXP cgroup) {
+  const char *dir = CHAR(STRING_ELT(cgroup, 0));
+  size_t size = 64, num = 0, nfound = 0, i;
+  pid_t *pids = (pid_t*) R_alloc(size, sizeof(pid_t)), mypid = getpid();
+  double *created;
+  SEXP result;
+
+  if (psll_linux_init_time()) ps__throw_error();
+  psl__cgroup_pids(dir, &pids, &num, &size);
+  created = (double*) R_alloc(num ? num : 1, sizeof(double));
+
+  for (i = 0; i < num; i++) {
+    psl_stat_t stat;
+    if (pids[i] == mypid) continue;
+    if (psll__parse_stat_file(pids[i], &stat, 0) == -1) continue;
+    pids[nfound] = pids[i];
+    created[nfound++] = psll_linux_boot_time +
+      stat.starttime * psll_linux_clock_period;
+  }
+
+  PROTECT(result = allocVector(VECSXP, nfound));
+  for (i = 0; i < nfound; i++) {
+    SET_VECTOR_ELT(result, i, psll__handle(pids[i], created[i]));
+  }
+
+  UNPROTECT(1);
+  return result;
+}
+
+/* SIGKILL goes via cgroup.kill, if the kernel has it (5.14 and above).
+   Otherwise we freeze the cgroup, so the processes cannot fork while we
+   signal them one by one. */
+
+SEXP psl__cgroup_kill(SEXP cgroup, SEXP sig) {
+  const char *dir = CHAR(STRING_ELT(cgroup, 0));
+  int csig = INTEGER(sig)[0], frozen = 0, killall = 0;
+  size_t size = 64, num = 0, nfound = 0, i;
+  pid_t *pids = (pid_t*) R_alloc(size, sizeof(pid_t)), mypid = getpid();
+  char path[PATH_MAX], (*names)[PSL_NAME_LEN];
+  SEXP result, rnames;
+
+  if (psl__cgroup_move_out(dir, CHAR(STRING_ELT(cgroup, 1)))) {
+    ps__set_error_from_errno();
+    ps__throw_error();
+  }
+
+  snprintf(path, sizeof(path), "%s/cgroup.kill", dir);
+  killall = csig == SIGKILL && access(path, W_OK) == 0;
+  if (!killall) {
+    snprintf(path, sizeof(path), "%s/cgroup.freeze", dir);
+    frozen = psl__write_file(path, "1") == 0;
+    if (frozen) psl__cgroup_wait(dir, "frozen 1", 1000);
+  }
+
+  psl__cgroup_pids(dir, &pids, &num, &size);
+  names = (char(*)[PSL_NAME_LEN]) R_alloc(num ? num : 1, PSL_NAME_LEN);
+  for (i = 0; i < num; i++) {
+    psl_stat_t stat;
+    char *name;
+    if (pids[i] == mypid) continue;
+    if (psll__parse_stat_file(pids[i], &stat, &name) == -1) continue;
+    strncpy(names[nfound], name, PSL_NAME_LEN - 1);
+    names[nfound][PSL_NAME_LEN - 1] = '\0';
+    pids[nfound++] = pids[i];
+  }
+
+  if (killall) {
+    snprintf(path, sizeof(path), "%s/cgroup.kill", dir);
+    killall = psl__write_file(path, "1") == 0;
+  }
+  if (!killall) {
+    for (i = 0; i < nfound; i++) {
+      if (kill(pids[i], csig) == -1) pids[i] = 0;
+    }
+  }
+  if (frozen) {
+    snprintf(path, sizeof(path), "%s/cgroup.freeze", dir);
+    psl__write_file(path, "0");
+  }
+
+  for (i = 0, num = 0; i < nfound; i++) if (pids[i] != 0) num++;
+  PROTECT(result = allocVector(INTSXP, num));
+  PROTECT(rnames = allocVector(STRSXP, num));
+  for (i = 0, num = 0; i < nfound; i++) {
+    if (pids[i] == 0) continue;
+    INTEGER(result)[num] = pids[i];
+    SET_STRING_ELT(rnames, num++, mkChar(names[i]));
+  }
+  setAttrib(result, R_NamesSymbol, rnames);
+
+  UNPROTECT(2);
+  return result;
+}
+
+/* Remove the cgroup, once all processes are gone from it. */
+
+SEXP psl__cgroup_remove(SEXP cgroup, SEXP timeout) {
+  const char *dir = CHAR(STRING_ELT(cgroup, 0));
+  if (access(dir, F_OK) == -1 && errno == ENOENT) return ScalarLogical(1);
+  if (psl__cgroup_wait(dir, "populated 0", INTEGER(timeout)[0])) {
+    return ScalarLogical(0);
+  }
+  return ScalarLogical(psl__cgroup_rmdir(dir) == 0);
+}
+
+/* ------------------------------------------------------------------- */
+/* Child subreaper                                                      */
+/* ------------------------------------------------------------------- */
+
+/* If R is a child subreaper, then the orphaned processes in its subtree
+   are reparented to R, instead of init, so they stay its descendants.
+   R does not wait for them, so they stay zombies, unless we reap them.
+   We only reap the pids we are asked to, so we do not take the exit
+   status of the other children, e.g. the ones that processx waits for. */
+
+SEXP psl__subreaper(SEXP enable) {
+  int old = 0;
+
+  if (prctl(PR_GET_CHILD_SUBREAPER, &old) == -1) {
+    ps__set_error_from_errno();
+    ps__throw_error();
+  }
+  if (!isNull(enable) &&
+      prctl(PR_SET_CHILD_SUBREAPER, (unsigned long) LOGICAL(enable)[0])
+      == -1) {
+    ps__set_error_from_errno();
+    ps__throw_error();
+  }
+
+  return ScalarLogical(old != 0);
+}
+
+/* Reap the ones in `pids` that are our children. The others are
+   ignored. Waits at most `timeout` milliseconds for them to exit, and
+   returns the reaped pids. */
+
+SEXP psl__reap(SEXP pids, SEXP timeout) {
+  int i, n = LENGTH(pids), ntodo = 0, nreaped = 0, delay = 1;
+  int ctimeout = INTEGER(timeout)[0];
+  pid_t *todo = (pid_t*) R_alloc(n ? n : 1, sizeof(pid_t));
+  pid_t mypid = getpid();
+  double deadline = psl__now() + ctimeout / 1000.0;
+  SEXP result;
+
+  for (i = 0; i < n; i++) {
+    char path[64], buf[2048];
+    psl_stat_t stat;
+    snprintf(path, sizeof(path), "/proc/%d/stat", INTEGER(pids)[i]);
+    if (ps__read_file_buf(path, buf, sizeof(buf)) <= 0) continue;
+    if (psll__parse_stat(buf, &stat, 0)) continue;
+    if (stat.ppid == mypid) todo[ntodo++] = INTEGER(pids)[i];
+  }
+
+  PROTECT(result = allocVector(INTSXP, ntodo));
+  for (;;) {
+    int left = 0;
+    struct timespec ts;
+    for (i = 0; i < ntodo; i++) {
+      siginfo_t info;
+      if (todo[i] == 0) continue;
+      info.si_pid = 0;
+      if (waitid(P_PID, todo[i], &info, WEXITED | WNOHANG) == -1) {
+	/* Reaped by someone else */
+	if (errno == ECHILD) todo[i] = 0; else left++;
+	continue;
+      }
+      if (info.si_pid == 0) {
+	left++;
+      } else {
+	INTEGER(result)[nreaped++] = todo[i];
+	todo[i] = 0;
+      }
+    }
+    if (left == 0 || psl__now() >= deadline) break;
+    R_CheckUserInterrupt();
+    ts.tv_sec = 0;
+    ts.tv_nsec = delay * 1000000L;
+    nanosleep(&ts, NULL);
+    if (delay < PSL_WAIT_MAX_DELAY) delay *= 2;
+  }
+
+  if (nreaped < ntodo) {
+    result = lengthgets(result, nreaped);
+  }
+  UNPROTECT(1);
+  return result;
+}
+
+/* ------------------------------------------------------------------- */
+/* Terminating process trees                                            */
+/* ------------------------------------------------------------------- */
+
+/* All steps happen here, without returning to R in between:
+   1. SIGSTOP every process, so they cannot fork any more,
+   2. add and stop their descendants, until there are no new ones,
+   3. send SIGTERM, then SIGCONT,
+   4. wait at most `grace` milliseconds for them to exit,
+   5. SIGKILL the survivors, and wait for them as well.
+   Signals go via the pidfd, if we have one, so a reused pid is never
+   signalled. */
+
+#define PSL_TERM_RUNNING   -1
+#define PSL_TERM_GONE       0
+#define PSL_TERM_TERMINATED 1
+#define PSL_TERM_KILLED     2
+#define PSL_TERM_FAILED     3
+#define PSL_TERM_ALIVE      4
+#define PSL_TERM_KILL_WAIT  1000
+
+static int psl__term_signal(SEXP p, int sig) {
+  ps_handle_t *handle = R_ExternalPtrAddr(p);
+  int ret = psll__pidfd_kill(handle, sig);
+  if (ret == 1) {
+    if (psl__wait_done(handle)) {
+      errno = ESRCH;
+      return -1;
+    }
+    ret = kill(handle->pid, sig);
+  }
+  return ret;
+}
+
+static void psl__term_stop(SEXP p, int *outcome) {
+  if (psl__wait_done(R_ExternalPtrAddr(p))) {
+    *outcome = PSL_TERM_GONE;
+  } else if (psl__term_signal(p, SIGSTOP) == -1) {
+    *outcome = errno == ESRCH ? PSL_TERM_GONE : PSL_TERM_FAILED;
+  } else {
+    *outcome = PSL_TERM_RUNNING;
+  }
+}
+
+/* Wait for the running ones, and set their outcome to `status` */
+
+static void psl__term_wait(SEXP all, int *outcome, R_xlen_t num,
+			   int timeout, int status) {
+  R_xlen_t i, nrun = 0;
+  SEXP run, done;
+
+  for (i = 0; i < num; i++) if (outcome[i] == PSL_TERM_RUNNING) nrun++;
+  if (nrun == 0) return;
+  PROTECT(run = allocVector(VECSXP, nrun));
+  for (i = 0, nrun = 0; i < num; i++) {
+    if (outcome[i] == PSL_TERM_RUNNING) {
+      SET_VECTOR_ELT(run, nrun++, VECTOR_ELT(all, i));
+    }
+  }
+  PROTECT(done = psl__wait(run, ScalarInteger(timeout), ScalarLogical(1)));
+  for (i = 0, nrun = 0; i < num; i++) {
+    if (outcome[i] != PSL_TERM_RUNNING) continue;
+    if (LOGICAL(done)[nrun++]) outcome[i] = status;
+  }
+  UNPROTECT(2);
+}
+
+SEXP psl__terminate(SEXP handles, SEXP grace) {
+  R_xlen_t i, j, num = XLENGTH(handles), n = 0, cap;
+  int cgrace = INTEGER(grace)[0], *outcome;
+  pid_t *pids, *tpids, mypid = getpid();
+  size_t npids;
+  SEXP all, names, result;
+
+  if (psll_linux_init_time()) ps__throw_error();
+
+  /* A process is only added once, so this is enough */
+  if (psl__list_pids(&pids, &npids)) {
+    ps__set_error_from_errno();
+    ps__throw_error();
+  }
+  free(pids);
+  cap = num + npids;
+  PROTECT(all = allocVector(VECSXP, cap));
+  PROTECT(names = allocVector(STRSXP, cap));
+  outcome = (int*) R_alloc(cap ? cap : 1, sizeof(int));
+  tpids = (pid_t*) R_alloc(cap ? cap : 1, sizeof(pid_t));
+
+  for (i = 0; i < num; i++) {
+    SEXP p = VECTOR_ELT(handles, i);
+    ps_handle_t *handle = R_ExternalPtrAddr(p);
+    psl_stat_t stat;
+    char path[64], buf[2048], *name;
+    if (!handle) error("Process pointer cleaned up already");
+    if (handle->pid == 0 || handle->pid == mypid) continue;
+    for (j = 0; j < n; j++) if (tpids[j] == handle->pid) break;
+    if (j < n) continue;
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) handle->pid);
+    if (ps__read_file_buf(path, buf, sizeof(buf)) > 0 &&
+	!psll__parse_stat(buf, &stat, &name)) {
+      SET_STRING_ELT(names, n, mkChar(name));
+    } else {
+      SET_STRING_ELT(names, n, NA_STRING);
+    }
+    SET_VECTOR_ELT(all, n, p);
+    tpids[n] = handle->pid;
+    psl__term_stop(p, &outcome[n++]);
+  }
+
+  /* Descendants, they might have been forked before we stopped the
+     parent. Go on until there are no new ones. */
+  for (;;) {
+    R_xlen_t added = 0;
+    size_t k;
+    if (psl__list_pids(&pids, &npids)) break;
+    for (k = 0; k < npids && n < cap; k++) {
+      psl_stat_t stat;
+      char path[64], buf[2048], *name;
+      SEXP p;
+      if (pids[k] == mypid) continue;
+      for (j = 0; j < n; j++) if (tpids[j] == pids[k]) break;
+      if (j < n) continue;
+      snprintf(path, sizeof(path), "/proc/%d/stat", (int) pids[k]);
+      if (ps__read_file_buf(path, buf, sizeof(buf)) <= 0) continue;
+      if (psll__parse_stat(buf, &stat, &name)) continue;
+      for (j = 0; j < n; j++) {
+	if (tpids[j] == stat.ppid && outcome[j] == PSL_TERM_RUNNING) break;
+      }
+      if (j == n) continue;
+      p = psll__handle(pids[k], psll_linux_boot_time +
+		       stat.starttime * psll_linux_clock_period);
+      SET_VECTOR_ELT(all, n, p);
+      SET_STRING_ELT(names, n, mkChar(name));
+      tpids[n] = pids[k];
+      psl__term_stop(p, &outcome[n++]);
+      added++;
+    }
+    free(pids);
+    if (added == 0) break;
+  }
+
+  for (i = 0; i < n; i++) {
+    if (outcome[i] != PSL_TERM_RUNNING) continue;
+    if (psl__term_signal(VECTOR_ELT(all, i), SIGTERM) == -1) {
+      outcome[i] = errno == ESRCH ? PSL_TERM_TERMINATED : PSL_TERM_FAILED;
+    }
+  }
+  for (i = 0; i < n; i++) {
+    if (outcome[i] != PSL_TERM_FAILED) {
+      psl__term_signal(VECTOR_ELT(all, i), SIGCONT);
+    }
+  }
+
+  psl__term_wait(all, outcome, n, cgrace, PSL_TERM_TERMINATED);
+
+  for (i = 0; i < n; i++) {
+    if (outcome[i] != PSL_TERM_RUNNING) continue;
+    if (psl__term_signal(VECTOR_ELT(all, i), SIGKILL) == -1) {
+      outcome[i] = errno == ESRCH ? PSL_TERM_TERMINATED : PSL_TERM_FAILED;
+    }
+  }
+
+  psl__term_wait(all, outcome, n, PSL_TERM_KILL_WAIT, PSL_TERM_KILLED);
+
+  PROTECT(result = allocVector(VECSXP, 3));
+  SET_VECTOR_ELT(result, 0, lengthgets(all, n));
+  SET_VECTOR_ELT(result, 1, lengthgets(names, n));
+  SET_VECTOR_ELT(result, 2, allocVector(INTSXP, n));
+  for (i = 0; i < n; i++) {
+    INTEGER(VECTOR_ELT(result, 2))[i] =
+      outcome[i] == PSL_TERM_RUNNING ? PSL_TERM_ALIVE : outcome[i];
+  }
+
+  UNPROTECT(3);
+  return result;
+}
+
+/* For bench/stat.R: read the stat files of all processes once, then
+   parse all of them `reps` times, with sscanf() and with the tokenizer.
+   Returns the two run times, in seconds. Only compiled if configure
+   was run with PS_BENCH set, see bench/stat.R. */
+
+#ifdef PS__BENCH
+
+#define PSL_STAT_BUFFER 2048
+
+SEXP psl__parse_stat_bench(SEXP reps) {
+  int r, creps = INTEGER(reps)[0];
+  pid_t *pids;
+  size_t i, num, nfiles = 0;
+  char path[64], *files, *work;
+  psl_stat_t stat;
+  double start, elapsed[2];
+  SEXP result;
+
+  if (psl__list_pids(&pids, &num)) {
+    ps__set_error_from_errno();
+    ps__throw_error();
+  }
+  PROTECT_PTR(pids);
+
+  files = R_alloc(num ? num : 1, PSL_STAT_BUFFER);
+  work = R_alloc(1, PSL_STAT_BUFFER);
+  for (i = 0; i < num; i++) {
+    char *buf = files + nfiles * PSL_STAT_BUFFER;
+    ssize_t len;
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pids[i]);
+    len = ps__read_file_buf(path, buf, PSL_STAT_BUFFER);
+    if (len <= 0) continue;
+    buf[len - 1] = '\0';
+    nfiles++;
+  }
+
+  start = psl__now();
+  for (r = 0; r < creps; r++) {
+    for (i = 0; i < nfiles; i++) {
+      memcpy(work, files + i * PSL_STAT_BUFFER, PSL_STAT_BUFFER);
+      psll__parse_stat_sscanf(work, &stat, 0);
+    }
+  }
+  elapsed[0] = psl__now() - start;
+
+  start = psl__now();
+  for (r = 0; r < creps; r++) {
+    for (i = 0; i < nfiles; i++) {
+      memcpy(work, files + i * PSL_STAT_BUFFER, PSL_STAT_BUFFER);
+      psll__parse_stat(work, &stat, 0);
+    }
+  }
+  elapsed[1] = psl__now() - start;
+
+  PROTECT(result = allocVector(REALSXP, 2));
+  REAL(result)[0] = elapsed[0];
+  REAL(result)[1] = elapsed[1];
+
+  UNPROTECT(2);
+  return result;
+}
+
+#endif
@@ -250,7 +250,7 @@ SEXP psll_status(SEXP p) {
 SEXP psll_username(SEXP p) {
   ps_handle_t *handle = R_ExternalPtrAddr(p);
   struct kinfo_proc kp;
-  SEXP ruid, pw, result;
+  const char *name;
 
   if (!handle) error("Process pointer cleaned up already");
 
@@ -258,12 +258,14 @@ SEXP psll_username(SEXP p) {
 
   PS__CHECK_KINFO(kp, handle);
 
-  PROTECT(ruid = ScalarInteger(kp.kp_eproc.e_pcred.p_ruid));
-  PROTECT(pw = ps__get_pw_uid(ruid));
-  PROTECT(result = VECTOR_ELT(pw, 0));
+  name = ps__username(kp.kp_eproc.e_pcred.p_ruid);
+  if (!name) {
+    ps__set_error("Cannot find user with uid %d",
+		  (int) kp.kp_eproc.e_pcred.p_ruid);
+    ps__throw_error();
+  }
 
-  UNPROTECT(3);
-  return result;
+  return mkString(name);
 }
 
 
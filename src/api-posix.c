@@ -17,17 +17,27 @@ SEXP psll_send_signal(SEXP p, SEXP sig) {
 	  "calling process (Sys.getpid()) instead of PID 0");
   }
 
-  running = psll_is_running(p);
-  if (!LOGICAL(running)[0]) {
-    ps__no_such_process(handle->pid, 0);
-    ps__throw_error();
-  }
+#ifdef PS__LINUX
+  /* No race here, the pidfd always refers to our process */
+  ret = psll__pidfd_kill(handle, csig);
+#else
+  ret = 1;
+#endif
+
+  if (ret == 1) {
+    running = psll_is_running(p);
+    if (!LOGICAL(running)[0]) {
+      ps__no_such_process(handle->pid, 0);
+      ps__throw_error();
+    }
+
+    /* TODO: this is still a race here. We would need to SIGSTOP the
+       process first, then check the timestamp, and then send the signal
+       (if not SIGSTOP), or send a SIGCONT. */
 
-  /* TODO: this is still a race here. We would need to SIGSTOP the
-     process first, then check the timestamp, and then send the signal
-     (if not SIGSTOP), or send a SIGCONT. */
+    ret = kill(handle->pid, csig);
+  }
 
-  ret = kill(handle->pid, csig);
   if (ret == -1) {
     if (errno == ESRCH) {
       ps__no_such_process(handle->pid, 0);
@@ -10,15 +10,6 @@ void ps__dummy(const char *what) {
   ps__throw_error();
 }
 
-/* Not implemented on Linux, only on Windows and macOS */
-#ifdef  PS__LINUX
-#ifndef PS__MACOS
-#ifndef PS__WINDOWS
-void ps__pids()          { ps__dummy("ps_pids"); }
-#endif
-#endif
-#endif
-
 /* Not implemented on Windows */
 #ifdef PS__WINDOWS
 #ifndef PS__POSIX
@@ -26,6 +17,7 @@ void psp__pid_exists()   { ps__dummy("psp__pid_exists"); }
 void psp__zombie()       { ps__dummy("psp__zombie"); }
 void psp__waitpid()      { ps__dummy("psp__waitpid"); }
 void psp__stat_st_rdev() { ps__dummy("psp__stat_st_rdev"); }
+void psp__usernames()    { ps__dummy("psp__usernames"); }
 #endif
 #endif
 
@@ -39,6 +31,31 @@ void psw__realpath()     { ps__dummy("psw__realpath"); }
 #ifndef PS__LINUX
 #if defined(PS__WINDOWS) || defined(PS__MACOS)
 void ps__inet_ntop()     { ps__dummy("ps__inet_ntop"); }
+void ps__snapshot()      { ps__dummy("ps__snapshot"); }
+void psl__pids()         { ps__dummy("psl__pids"); }
+void psl__snapshot_take() { ps__dummy("psl__snapshot_take"); }
+void psl__snapshot_diff() { ps__dummy("psl__snapshot_diff"); }
+void psl__oneshot()      { ps__dummy("psl__oneshot"); }
+void psl__handles()      { ps__dummy("psl__handles"); }
+void psl__tree_new()     { ps__dummy("psl__tree_new"); }
+void psl__tree_descendants() { ps__dummy("psl__tree_descendants"); }
+void psl__tree_ancestors() { ps__dummy("psl__tree_ancestors"); }
+void psl__children()     { ps__dummy("psl__children"); }
+void psl__wait()         { ps__dummy("psl__wait"); }
+void psl__find_tree()    { ps__dummy("psl__find_tree"); }
+void psl__cgroup_enter() { ps__dummy("psl__cgroup_enter"); }
+void psl__cgroup_leave() { ps__dummy("psl__cgroup_leave"); }
+void psl__cgroup_find()  { ps__dummy("psl__cgroup_find"); }
+void psl__cgroup_kill()  { ps__dummy("psl__cgroup_kill"); }
+void psl__cgroup_remove() { ps__dummy("psl__cgroup_remove"); }
+void psl__subreaper()    { ps__dummy("psl__subreaper"); }
+void psl__reap()         { ps__dummy("psl__reap"); }
+void psl__terminate()    { ps__dummy("psl__terminate"); }
+void psl__stat()         { ps__dummy("ps_stat"); }
+void psl__keep_open()    { ps__dummy("ps_keep_open"); }
+void psl__memory_full_info() { ps__dummy("ps_memory_full_info"); }
+void psl__io_counters()  { ps__dummy("ps_io_counters"); }
+void psl__threads()      { ps__dummy("ps_threads"); }
 #endif
 #endif
 
@@ -51,6 +68,31 @@ void ps__boot_time()     { ps__dummy("ps_boot_time"); }
 void ps__cpu_count_logical()  { ps__dummy("ps_cpu_count"); }
 void ps__cpu_count_physical() { ps__dummy("ps_cpu_count"); }
 void ps__users()         { ps__users("ps_users"); }
+void ps__snapshot()      { ps__dummy("ps__snapshot"); }
+void psl__pids()         { ps__dummy("psl__pids"); }
+void psl__snapshot_take() { ps__dummy("psl__snapshot_take"); }
+void psl__snapshot_diff() { ps__dummy("psl__snapshot_diff"); }
+void psl__oneshot()      { ps__dummy("psl__oneshot"); }
+void psl__handles()      { ps__dummy("psl__handles"); }
+void psl__tree_new()     { ps__dummy("psl__tree_new"); }
+void psl__tree_descendants() { ps__dummy("psl__tree_descendants"); }
+void psl__tree_ancestors() { ps__dummy("psl__tree_ancestors"); }
+void psl__children()     { ps__dummy("psl__children"); }
+void psl__wait()         { ps__dummy("psl__wait"); }
+void psl__find_tree()    { ps__dummy("psl__find_tree"); }
+void psl__cgroup_enter() { ps__dummy("psl__cgroup_enter"); }
+void psl__cgroup_leave() { ps__dummy("psl__cgroup_leave"); }
+void psl__cgroup_find()  { ps__dummy("psl__cgroup_find"); }
+void psl__cgroup_kill()  { ps__dummy("psl__cgroup_kill"); }
+void psl__cgroup_remove() { ps__dummy("psl__cgroup_remove"); }
+void psl__subreaper()    { ps__dummy("psl__subreaper"); }
+void psl__reap()         { ps__dummy("psl__reap"); }
+void psl__terminate()    { ps__dummy("psl__terminate"); }
+void psl__stat()         { ps__dummy("ps_stat"); }
+void psl__keep_open()    { ps__dummy("ps_keep_open"); }
+void psl__memory_full_info() { ps__dummy("ps_memory_full_info"); }
+void psl__io_counters()  { ps__dummy("ps_io_counters"); }
+void psl__threads()      { ps__dummy("ps_threads"); }
 
 void psll_handle()       { ps__dummy("ps_handle"); }
 void psll_format()       { ps__dummy("ps_format"); }
@@ -88,6 +130,7 @@ void psp__pid_exists()   { ps__dummy("psp__pid_exists"); }
 void psp__stat_st_rdev() { ps__dummy("psp__stat_st_rdev"); }
 void psp__zombie()       { ps__dummy("psp__zombie"); }
 void psp__waitpid()      { ps__dummy("psp__waitpid"); }
+void psp__usernames()    { ps__dummy("psp__usernames"); }
 
 void psw__realpath()     { ps__dummy("psw__realpath"); }
 
@@ -42,10 +42,13 @@ void *ps__set_error_impl(const char *class, int system_errno,
 
 void *ps__set_error(const char *msg, ...) {
   va_list args;
+  char buf[sizeof(ps__last_error_string)];
 
+  /* ps__set_error_impl() cannot take a va_list, so format here */
   va_start(args, msg);
-  ps__set_error_impl(0, 0, NA_INTEGER, msg, args);
+  vsnprintf(buf, sizeof(buf), msg, args);
   va_end(args);
+  ps__set_error_impl(0, 0, NA_INTEGER, "%s", buf);
 
   return NULL;
 }
@@ -101,6 +104,28 @@ void *ps__set_error_from_windows_error(long err) {
 }
 #endif
 
+static const char *ps__error_codes[PS__ERROR_MAX] = {
+  NULL, "no_such_process", "zombie_process", "access_denied", "os_error"
+};
+
+int ps__error_code_from_errno(int err) {
+  switch (err) {
+  case ENOENT:
+  case ESRCH:
+    return PS__NO_SUCH_PROCESS;
+  case EACCES:
+  case EPERM:
+    return PS__ACCESS_DENIED;
+  default:
+    return PS__OS_ERROR;
+  }
+}
+
+SEXP ps__error_code_string(int code) {
+  if (code <= PS__OK || code >= PS__ERROR_MAX) return NA_STRING;
+  return mkChar(ps__error_codes[code]);
+}
+
 SEXP ps__throw_error() {
   SEXP stopfun, call, out;
 
@@ -12,6 +12,7 @@ static const R_CallMethodDef callMethods[]  = {
   { "ps__cpu_count_logical",  (DL_FUNC) ps__cpu_count_logical,  0 },
   { "ps__cpu_count_physical", (DL_FUNC) ps__cpu_count_physical, 0 },
   { "ps__users",              (DL_FUNC) ps__users,              0 },
+  { "ps__snapshot",           (DL_FUNC) ps__snapshot,           4 },
 
   /* ps_handle API */
   { "psll_pid",          (DL_FUNC) psll_pid,          1 },
@@ -54,9 +55,38 @@ static const R_CallMethodDef callMethods[]  = {
   { "psp__stat_st_rdev", (DL_FUNC) psp__stat_st_rdev, 1 },
   { "psp__zombie",       (DL_FUNC) psp__zombie,       0 },
   { "psp__waitpid",      (DL_FUNC) psp__waitpid,      1 },
+  { "psp__usernames",    (DL_FUNC) psp__usernames,    1 },
 
   { "psw__realpath",     (DL_FUNC) psw__realpath,     1 },
 
+  { "psl__pids",         (DL_FUNC) psl__pids,         1 },
+  { "psl__snapshot_take", (DL_FUNC) psl__snapshot_take, 3 },
+  { "psl__snapshot_diff", (DL_FUNC) psl__snapshot_diff, 2 },
+  { "psl__oneshot",      (DL_FUNC) psl__oneshot,      2 },
+  { "psl__handles",      (DL_FUNC) psl__handles,      2 },
+  { "psl__tree_new",     (DL_FUNC) psl__tree_new,     0 },
+  { "psl__tree_descendants", (DL_FUNC) psl__tree_descendants, 3 },
+  { "psl__tree_ancestors", (DL_FUNC) psl__tree_ancestors, 2 },
+  { "psl__children",     (DL_FUNC) psl__children,     2 },
+  { "psl__wait",         (DL_FUNC) psl__wait,         3 },
+  { "psl__find_tree",    (DL_FUNC) psl__find_tree,    3 },
+  { "psl__cgroup_enter", (DL_FUNC) psl__cgroup_enter, 1 },
+  { "psl__cgroup_leave", (DL_FUNC) psl__cgroup_leave, 1 },
+  { "psl__cgroup_find",  (DL_FUNC) psl__cgroup_find,  1 },
+  { "psl__cgroup_kill",  (DL_FUNC) psl__cgroup_kill,  2 },
+  { "psl__cgroup_remove", (DL_FUNC) psl__cgroup_remove, 2 },
+  { "psl__subreaper",    (DL_FUNC) psl__subreaper,    1 },
+  { "psl__reap",         (DL_FUNC) psl__reap,         2 },
+  { "psl__terminate",    (DL_FUNC) psl__terminate,    2 },
+  { "psl__stat",         (DL_FUNC) psl__stat,         1 },
+#ifdef PS__BENCH
+  { "psl__parse_stat_bench", (DL_FUNC) psl__parse_stat_bench, 1 },
+#endif
+  { "psl__keep_open",    (DL_FUNC) psl__keep_open,    2 },
+  { "psl__memory_full_info", (DL_FUNC) psl__memory_full_info, 1 },
+  { "psl__io_counters",  (DL_FUNC) psl__io_counters,  1 },
+  { "psl__threads",      (DL_FUNC) psl__threads,      2 },
+
   { NULL, NULL, 0 }
 };
 
@@ -34,6 +34,14 @@
 #include "common.h"
 #include "posix.h"
 
+#ifdef PS__HAVE_IO_URING
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+#endif
+
+typedef struct ps__uring_s ps__uring_t;
+void ps__uring_free(ps__uring_t *ring);
+
 int ps__read_file(const char *path, char **buffer, size_t buffer_size) {
   int fd = -1;
   ssize_t ret;
@@ -74,6 +82,275 @@ int ps__read_file(const char *path, char **buffer, size_t buffer_size) {
   return -1;
 }
 
+/* Like ps__read_file(), but reads into a buffer supplied by the caller
+   and never allocates, so it does not touch the R heap. At most
+   `buffer_size - 1` bytes are read, and the result is zero terminated.
+   Returns the number of bytes read, or -1 and sets errno. */
+
+ssize_t ps__read_file_buf(const char *path, char *buffer,
+			  size_t buffer_size) {
+  int fd;
+  ssize_t ret;
+  size_t len = 0;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1) return -1;
+
+  do {
+    ret = read(fd, buffer + len, buffer_size - 1 - len);
+    if (ret == -1) {
+      int err = errno;
+      close(fd);
+      errno = err;
+      return -1;
+    }
+    len += ret;
+  } while (ret > 0 && len < buffer_size - 1);
+
+  close(fd);
+  buffer[len] = '\0';
+
+  return len;
+}
+
+/* Batched reads of small files, with io_uring. This is used by the
+   process table snapshot, to read the /proc files of many processes
+   with a few system calls. We do not use liburing, just the raw system
+   calls, because we only need a small part of the interface.
+
+   ps__uring_new() returns NULL if io_uring is not available, e.g. the
+   kernel is too old, it is disabled, or a seccomp filter blocks it.
+   The caller then needs to fall back to ps__read_file_buf(). */
+
+#ifdef PS__HAVE_IO_URING
+
+struct ps__uring_s {
+  int fd;
+  unsigned entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_size, cq_size, sqes_size;
+};
+
+static int ps__uring_probe(int fd) {
+  struct io_uring_probe *probe;
+  size_t size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+  int ops[] = { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE };
+  int i, ret = 0;
+
+  probe = calloc(1, size);
+  if (!probe) return -1;
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+	      probe, 256) < 0) {
+    free(probe);
+    return -1;
+  }
+  for (i = 0; i < sizeof(ops) / sizeof(int); i++) {
+    if (ops[i] > probe->last_op ||
+	!(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+      ret = -1;
+    }
+  }
+  free(probe);
+  return ret;
+}
+
+ps__uring_t *ps__uring_new(unsigned entries) {
+  struct io_uring_params params;
+  ps__uring_t *ring = calloc(1, sizeof(ps__uring_t));
+  char *sq, *cq;
+
+  if (!ring) return NULL;
+  memset(&params, 0, sizeof(params));
+  ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd < 0) goto error;
+  if (ps__uring_probe(ring->fd)) goto error;
+
+  ring->entries = params.sq_entries;
+  ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_size = params.cq_off.cqes +
+    params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+    ring->cq_size = ring->sq_size;
+  }
+
+  ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ptr == MAP_FAILED) { ring->sq_ptr = NULL; goto error; }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ptr = ring->sq_ptr;
+  } else {
+    ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd,
+			IORING_OFF_CQ_RING);
+    if (ring->cq_ptr == MAP_FAILED) { ring->cq_ptr = NULL; goto error; }
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) { ring->sqes = NULL; goto error; }
+
+  sq = ring->sq_ptr;
+  ring->sq_head = (unsigned*) (sq + params.sq_off.head);
+  ring->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned*) (sq + params.sq_off.array);
+  cq = ring->cq_ptr;
+  ring->cq_head = (unsigned*) (cq + params.cq_off.head);
+  ring->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+  return ring;
+
+ error:
+  ps__uring_free(ring);
+  return NULL;
+}
+
+void ps__uring_free(ps__uring_t *ring) {
+  if (!ring) return;
+  if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr) {
+    munmap(ring->cq_ptr, ring->cq_size);
+  }
+  if (ring->sq_ptr) munmap(ring->sq_ptr, ring->sq_size);
+  if (ring->fd >= 0) close(ring->fd);
+  free(ring);
+}
+
+/* Submit the prepared `num` entries, and wait for all of them. The
+   result of entry `i` is put into `res[i]`. */
+
+static int ps__uring_run(ps__uring_t *ring, unsigned num, int *res) {
+  unsigned submitted = 0, done = 0, head, tail;
+  int ret;
+
+  __atomic_store_n(ring->sq_tail, *ring->sq_tail + num, __ATOMIC_RELEASE);
+
+  while (done < num) {
+    /* If not all entries are submitted, then the kernel does not wait
+       for the completions, so we can ask for all of them here. */
+    ret = syscall(__NR_io_uring_enter, ring->fd, num - submitted,
+		  num - done, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0 && errno != EINTR) return -1;
+    if (ret > 0) submitted += ret;
+
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+      struct io_uring_cqe *cqe = ring->cqes + (head & *ring->cq_mask);
+      res[cqe->user_data] = cqe->res;
+      head++;
+      done++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  return 0;
+}
+
+static struct io_uring_sqe *ps__uring_sqe(ps__uring_t *ring, unsigned i,
+					  int op, unsigned long long data) {
+  unsigned idx = (*ring->sq_tail + i) & *ring->sq_mask;
+  struct io_uring_sqe *sqe = ring->sqes + idx;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = op;
+  sqe->user_data = data;
+  ring->sq_array[idx] = idx;
+  return sqe;
+}
+
+/* Read `num` files, each into its own buffer of `buffer_size` bytes.
+   Like for ps__read_file_buf() at most `buffer_size - 1` bytes are
+   read, with a single read, and the result is zero terminated.
+   `lens[i]` is the number of bytes read for file `i`, or a negative
+   errno value on error. Returns -1 if io_uring itself failed, and then
+   the files need to be read synchronously. */
+
+int ps__uring_read_files(ps__uring_t *ring, size_t num, const char **paths,
+			 char **buffers, size_t buffer_size, ssize_t *lens) {
+  int *fds, *res;
+  size_t from, to, i;
+  unsigned n;
+
+  fds = malloc(ring->entries * 2 * sizeof(int));
+  if (!fds) return -1;
+  res = fds + ring->entries;
+
+  for (from = 0; from < num; from = to) {
+    to = from + ring->entries < num ? from + ring->entries : num;
+    n = to - from;
+
+    /* Open */
+    for (i = 0; i < n; i++) {
+      struct io_uring_sqe *sqe = ps__uring_sqe(ring, i, IORING_OP_OPENAT, i);
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (unsigned long) paths[from + i];
+      sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    }
+    if (ps__uring_run(ring, n, fds)) goto error;
+
+    /* Read */
+    for (i = 0; i < n; i++) {
+      struct io_uring_sqe *sqe;
+      if (fds[i] < 0) {
+	sqe = ps__uring_sqe(ring, i, IORING_OP_NOP, i);
+      } else {
+	sqe = ps__uring_sqe(ring, i, IORING_OP_READ, i);
+	sqe->fd = fds[i];
+	sqe->addr = (unsigned long) buffers[from + i];
+	sqe->len = buffer_size - 1;
+	sqe->off = 0;
+      }
+    }
+    if (ps__uring_run(ring, n, res)) goto error;
+    for (i = 0; i < n; i++) {
+      lens[from + i] = fds[i] < 0 ? fds[i] : res[i];
+      if (lens[from + i] >= 0) buffers[from + i][lens[from + i]] = '\0';
+    }
+
+    /* Close */
+    for (i = 0; i < n; i++) {
+      struct io_uring_sqe *sqe;
+      if (fds[i] < 0) {
+	sqe = ps__uring_sqe(ring, i, IORING_OP_NOP, i);
+      } else {
+	sqe = ps__uring_sqe(ring, i, IORING_OP_CLOSE, i);
+	sqe->fd = fds[i];
+      }
+    }
+    if (ps__uring_run(ring, n, res)) goto error;
+  }
+
+  free(fds);
+  return 0;
+
+ error:
+  /* We might leak some fds here, but this really should not happen */
+  free(fds);
+  return -1;
+}
+
+#else
+
+ps__uring_t *ps__uring_new(unsigned entries) {
+  return NULL;
+}
+
+void ps__uring_free(ps__uring_t *ring) { }
+
+int ps__uring_read_files(ps__uring_t *ring, size_t num, const char **paths,
+			 char **buffers, size_t buffer_size, ssize_t *lens) {
+  return -1;
+}
+
+#endif
+
 SEXP ps__inet_ntop(SEXP raw, SEXP fam) {
   char dst[INET6_ADDRSTRLEN];
   int af = INTEGER(fam)[0];
@@ -155,6 +155,161 @@ SEXP ps__get_pw_uid(SEXP r_uid) {
     "pw_shell",  pwd->pw_shell);
 }
 
+/* uid -> user name cache. getpwuid() can be slow, e.g. with LDAP or
+   sssd, so we cache the names, including the uids without a user. The
+   cache is dropped if the modification time of /etc/passwd changes. */
+
+typedef struct {
+  int used;			/* any uid is valid, even (uid_t) -1 */
+  uid_t uid;
+  char *name;			/* NULL if no such user */
+} ps__uid_entry_t;
+
+static ps__uid_entry_t *ps__uid_cache = NULL;
+static size_t ps__uid_cache_size = 0, ps__uid_cache_num = 0;
+static struct {
+  time_t mtime;
+  ino_t ino;
+  off_t size;
+} ps__uid_cache_passwd;
+
+static void ps__uid_cache_clear(void) {
+  size_t i;
+  for (i = 0; i < ps__uid_cache_size; i++) {
+    if (ps__uid_cache[i].name) free(ps__uid_cache[i].name);
+  }
+  free(ps__uid_cache);
+  ps__uid_cache = NULL;
+  ps__uid_cache_size = ps__uid_cache_num = 0;
+}
+
+static void ps__uid_cache_check(void) {
+  struct stat st;
+  if (stat("/etc/passwd", &st)) {
+    memset(&st, 0, sizeof(st));
+  }
+  /* The mtime only has a one second resolution, but the file is
+     usually replaced when it changes, or at least its size changes. */
+  if (st.st_mtime != ps__uid_cache_passwd.mtime ||
+      st.st_ino != ps__uid_cache_passwd.ino ||
+      st.st_size != ps__uid_cache_passwd.size) {
+    ps__uid_cache_clear();
+    ps__uid_cache_passwd.mtime = st.st_mtime;
+    ps__uid_cache_passwd.ino = st.st_ino;
+    ps__uid_cache_passwd.size = st.st_size;
+  }
+}
+
+static size_t ps__uid_hash(uid_t uid, size_t size) {
+  return ((size_t) uid * 2654435761u) & (size - 1);
+}
+
+/* Returns the slot for uid, or an empty slot where it can be added.
+   The table is never full, see ps__uid_cache_add(). */
+
+static ps__uid_entry_t *ps__uid_cache_slot(uid_t uid, int *found) {
+  size_t i = ps__uid_hash(uid, ps__uid_cache_size);
+  while (1) {
+    ps__uid_entry_t *e = ps__uid_cache + i;
+    if (!e->used) {
+      *found = 0;
+      return e;
+    } else if (e->uid == uid) {
+      *found = 1;
+      return e;
+    }
+    i = (i + 1) & (ps__uid_cache_size - 1);
+  }
+}
+
+static int ps__uid_cache_grow(void) {
+  ps__uid_entry_t *old = ps__uid_cache;
+  size_t i, old_size = ps__uid_cache_size;
+  size_t size = old_size ? old_size * 2 : 64;
+  int found;
+
+  ps__uid_cache = calloc(size, sizeof(ps__uid_entry_t));
+  if (!ps__uid_cache) {
+    ps__uid_cache = old;
+    return -1;
+  }
+  ps__uid_cache_size = size;
+  for (i = 0; i < old_size; i++) {
+    if (old[i].used) {
+      *ps__uid_cache_slot(old[i].uid, &found) = old[i];
+    }
+  }
+  free(old);
+  return 0;
+}
+
+static const char *ps__username_cached(uid_t uid) {
+  ps__uid_entry_t *e = NULL;
+  struct passwd *pwd;
+  char *name = NULL;
+  int found = 0;
+
+  if (ps__uid_cache_size) e = ps__uid_cache_slot(uid, &found);
+  if (found) return e->name;
+
+  errno = 0;
+  pwd = getpwuid(uid);
+
+  /* Only cache a missing user if getpwuid() says so, see getpwuid(3).
+     Other errors, e.g. from NSS or LDAP, might be transient. */
+  if (!pwd && errno != 0 && errno != ENOENT && errno != ESRCH &&
+      errno != EBADF && errno != EPERM) {
+    return NULL;
+  }
+
+  /* Keep the load factor under 1/2 */
+  if (2 * (ps__uid_cache_num + 1) > ps__uid_cache_size) {
+    if (ps__uid_cache_grow()) return pwd ? pwd->pw_name : NULL;
+    e = ps__uid_cache_slot(uid, &found);
+  }
+  if (pwd) {
+    name = strdup(pwd->pw_name);
+    if (!name) return pwd->pw_name;
+  }
+  e->used = 1;
+  e->uid = uid;
+  e->name = name;
+  ps__uid_cache_num++;
+
+  return e->name;
+}
+
+/* User name of a uid, or NULL if there is no such user. The result
+   is owned by the cache, and it is valid until the next call. */
+
+const char *ps__username(uid_t uid) {
+  ps__uid_cache_check();
+  return ps__username_cached(uid);
+}
+
+/* Bulk version, /etc/passwd is only checked once */
+
+SEXP ps__usernames(SEXP uids) {
+  R_xlen_t i, n = XLENGTH(uids);
+  int *cuids = INTEGER(uids);
+  SEXP result = PROTECT(allocVector(STRSXP, n));
+
+  ps__uid_cache_check();
+
+  for (i = 0; i < n; i++) {
+    const char *name =
+      cuids[i] == NA_INTEGER ? NULL : ps__username_cached(cuids[i]);
+    SET_STRING_ELT(result, i, name ? mkChar(name) : NA_STRING);
+  }
+
+  UNPROTECT(1);
+  return result;
+}
+
+SEXP psp__usernames(SEXP uids) {
+  return ps__usernames(uids);
+}
+
 SEXP psp__stat_st_rdev(SEXP files) {
   size_t i, len = LENGTH(files);
   struct stat buf;
@@ -23,12 +23,83 @@ typedef struct {
 #include <unistd.h>
 #include <sys/types.h>
 
+/* All fields of /proc/<pid>/stat, after the pid and the command name,
+   in order, see proc(5). Older kernels have fewer fields, the missing
+   ones are zero. */
+
+typedef struct {
+  char state;
+  int ppid, pgrp, session, tty_nr, tpgid;
+  unsigned int flags;
+  unsigned long minflt, cminflt, majflt, cmajflt, utime, stime;
+  long int cutime, cstime, priority, nice, num_threads, itrealvalue;
+  unsigned long long starttime;
+  unsigned long vsize;
+  long rss;
+  unsigned long rsslim, startcode, endcode, startstack, kstkesp, kstkeip;
+  unsigned long signal, blocked, sigignore, sigcatch, wchan, nswap, cnswap;
+  int exit_signal, processor;
+  unsigned int rt_priority, policy;
+  unsigned long long delayacct_blkio_ticks;
+  unsigned long guest_time;
+  long cguest_time;
+  unsigned long start_data, end_data, start_brk, arg_start, arg_end;
+  unsigned long env_start, env_end;
+  int exit_code;
+} psl_stat_t;
+
+typedef struct {
+  char *data;
+  int len;
+} psl_oneshot_file_t;
+
+/* The /proc files cached within ps_oneshot(). `depth` is the number of
+   active (nested) ps_oneshot() calls. */
+
+typedef struct {
+  int depth;
+  int has_stat;
+  psl_stat_t stat;
+  char name[128];
+  psl_oneshot_file_t statm;
+  psl_oneshot_file_t status;
+  psl_oneshot_file_t io;
+} psl_oneshot_t;
+
+/* The /proc/<pid> directory and the frequently read files of a process,
+   kept open by ps_keep_open(). The files are opened on first use, and
+   re-read with pread() into `buf`, which is owned by the handle. */
+
+enum {
+  PSL_HELD_STAT = 0,
+  PSL_HELD_STATM,
+  PSL_HELD_STATUS,
+  PSL_HELD_IO,
+  PSL_HELD_MAX
+};
+
+typedef struct {
+  int fd;
+  size_t size;
+  char *buf;
+} psl_held_file_t;
+
+typedef struct {
+  int dirfd;
+  psl_held_file_t files[PSL_HELD_MAX];
+} psl_procfd_t;
+
 typedef struct {
   pid_t pid;
   double create_time;
   int gone;
+  psl_oneshot_t oneshot;
+  int pidfd;
+  psl_procfd_t *procfd;
 } ps_handle_t;
 
+int psll__pidfd_kill(ps_handle_t *handle, int sig);
+
 #endif
 
 #ifdef PS__WINDOWS
@@ -62,6 +133,10 @@ typedef struct {
 SEXP psll__is_running(ps_handle_t *handle);
 
 SEXP ps__get_pw_uid(SEXP r_uid);
+#ifdef PS__POSIX
+const char *ps__username(uid_t uid);
+SEXP ps__usernames(SEXP uids);
+#endif
 SEXP ps__define_signals();
 SEXP ps__define_errno();
 SEXP ps__define_socket_address_families();
@@ -90,6 +165,22 @@ void *ps__not_implemented(const char *what);
 
 void *ps__set_error_from_windows_error(long err);
 
+/* Error codes, for the bulk queries that do not throw errors, but
+   report them per process. The names are the classes of the
+   corresponding R conditions, PS__OK is NA. */
+
+typedef enum {
+  PS__OK = 0,
+  PS__NO_SUCH_PROCESS,
+  PS__ZOMBIE_PROCESS,
+  PS__ACCESS_DENIED,
+  PS__OS_ERROR,
+  PS__ERROR_MAX
+} ps_error_code_t;
+
+int ps__error_code_from_errno(int err);
+SEXP ps__error_code_string(int code);
+
 /* Build SEXP values */
 
 SEXP ps__build_string(const char *str, ...);
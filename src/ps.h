@@ -49,6 +49,7 @@ SEXP ps__boot_time();
 SEXP ps__cpu_count_logical();
 SEXP ps__cpu_count_physical();
 SEXP ps__users();
+SEXP ps__snapshot(SEXP columns, SEXP threads, SEXP uring, SEXP filter);
 
 /* Generic utils used from R */
 
@@ -61,6 +62,35 @@ SEXP psp__zombie();
 SEXP psp__waitpid(SEXP pid);
 SEXP psp__pid_exists(SEXP r_pid);
 SEXP psp__stat_st_rdev(SEXP files);
+SEXP psp__usernames(SEXP uids);
 
 SEXP psw__realpath(SEXP path);
+
+SEXP psl__pids(SEXP sort);
+SEXP psl__oneshot(SEXP p, SEXP enter);
+SEXP psl__handles(SEXP handles, SEXP what);
+SEXP psl__snapshot_take(SEXP io, SEXP threads, SEXP uring);
+SEXP psl__snapshot_diff(SEXP old_snap, SEXP new_snap);
+SEXP psl__tree_new();
+SEXP psl__tree_descendants(SEXP tree, SEXP p, SEXP recursive);
+SEXP psl__tree_ancestors(SEXP tree, SEXP p);
+SEXP psl__children(SEXP p, SEXP recursive);
+SEXP psl__wait(SEXP handles, SEXP timeout, SEXP all);
+SEXP psl__find_tree(SEXP marker, SEXP after, SEXP sig);
+SEXP psl__cgroup_enter(SEXP name);
+SEXP psl__cgroup_leave(SEXP cgroup);
+SEXP psl__cgroup_find(SEXP cgroup);
+SEXP psl__cgroup_kill(SEXP cgroup, SEXP sig);
+SEXP psl__cgroup_remove(SEXP cgroup, SEXP timeout);
+SEXP psl__subreaper(SEXP enable);
+SEXP psl__reap(SEXP pids, SEXP timeout);
+SEXP psl__terminate(SEXP handles, SEXP grace);
+SEXP psl__stat(SEXP p);
+#ifdef PS__BENCH
+SEXP psl__parse_stat_bench(SEXP reps);
+#endif
+SEXP psl__keep_open(SEXP p, SEXP keep);
+SEXP psl__memory_full_info(SEXP p);
+SEXP psl__io_counters(SEXP p);
+SEXP psl__threads(SEXP handles, SEXP strict);
 #endif